@@ -0,0 +1,182 @@
+#include "automorphism.h"
+#include <string>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <algorithm>
+#include <climits>
+#include "include/nauty/gtools.h"
+
+// nauty keeps its work space in static variables (unless it is built with
+// thread-local storage), so only one thread may run it at a time.
+static std::mutex nauty_mutex;
+// userautomproc has no user data argument, so the generators are collected here.
+static std::vector<Permutation>* collected_generators = nullptr;
+
+static void collect_generator(int count, int* perm, int* orbits, int numorbits, int stabvertex, int n) {
+    std::vector<int> generator(n);
+    for (int i = 0; i < n; i++) {
+        generator[i] = perm[i] + 1; // Convert to 1-based indexing
+    }
+    collected_generators->emplace_back(std::move(generator));
+}
+
+std::vector<Permutation> automorphism_generators(graph* g, int m_wordsize, int n) {
+    std::vector<Permutation> generators;
+    if (n == 0) return generators;
+    std::vector<int> lab(n), ptn(n), orbits(n);
+    DEFAULTOPTIONS_GRAPH(options);
+    options.userautomproc = collect_generator;
+    statsblk stats;
+    std::lock_guard<std::mutex> lock(nauty_mutex);
+    collected_generators = &generators;
+    densenauty(g, lab.data(), ptn.data(), orbits.data(), &options, &stats, m_wordsize, n, NULL);
+    collected_generators = nullptr;
+    return generators;
+}
+
+std::vector<Permutation> automorphism_generators(sparsegraph* sg) {
+    std::vector<Permutation> generators;
+    if (sg->nv == 0) return generators;
+    std::vector<int> lab(sg->nv), ptn(sg->nv), orbits(sg->nv);
+    DEFAULTOPTIONS_SPARSEGRAPH(options);
+    options.userautomproc = collect_generator;
+    statsblk stats;
+    std::lock_guard<std::mutex> lock(nauty_mutex);
+    collected_generators = &generators;
+    sparsenauty(sg, lab.data(), ptn.data(), orbits.data(), &options, &stats, NULL);
+    collected_generators = nullptr;
+    return generators;
+}
+
+// Product replacement steps done before the first random element is scored.
+static const int warm_up_steps = 50;
+
+/**
+ * Searches the group generated by the generators for the element with the
+ * shortest encoding, see find_automorphism.
+ * @param n The number of vertices.
+ * @param generators Generators of the automorphism group.
+ * @param search_budget The number of random group elements to try.
+ * @param size_with Callable size_t(const Permutation&) giving the encoded length.
+ * @return The best element found, the identity if there are no generators.
+ */
+template <typename SizeWith>
+static Permutation search_automorphisms(int n, const std::vector<Permutation>& generators, int search_budget,
+                                        SizeWith size_with) {
+    std::vector<int> identity(n);
+    std::iota(identity.begin(), identity.end(), 1);
+    if (generators.empty()) {
+        return Permutation(std::move(identity));
+    }
+    size_t best = 0;
+    size_t best_size = size_with(generators[0]);
+    for (size_t i = 1; i < generators.size(); i++) {
+        size_t size = size_with(generators[i]);
+        if (size < best_size) {
+            best = i;
+            best_size = size;
+        }
+    }
+    Permutation best_element = generators[best];
+    // Product replacement: a few copies of the generators are repeatedly
+    // multiplied with each other and the accumulated product is an (almost)
+    // uniformly random element of the group. The first steps stay close to
+    // the generators, so they are done as a warm-up without scoring.
+    std::mt19937 rng(1);
+    std::vector<Permutation> state;
+    while (state.size() < std::max<size_t>(10, generators.size())) {
+        state.push_back(generators[state.size() % generators.size()]);
+    }
+    Permutation element(std::move(identity));
+    std::uniform_int_distribution<size_t> pick(0, state.size() - 1);
+    for (int step = -warm_up_steps; step < search_budget; step++) {
+        size_t i = pick(rng);
+        size_t j = pick(rng);
+        if (i == j) j = (j + 1) % state.size();
+        state[i] = rng() % 2 ? state[i] * state[j] : state[i] * state[j].inverse();
+        element = element * state[i];
+        if (step < 0) continue;
+        size_t size = size_with(element);
+        if (size < best_size) {
+            best_element = element;
+            best_size = size;
+        }
+    }
+    return best_element;
+}
+
+Permutation find_automorphism(NautyGraph* g, AdjacencyEncoding encoding, int search_budget) {
+    std::vector<Permutation> generators = g->is_sparse() ? automorphism_generators(g->sparse_graph())
+                                                         : automorphism_generators(g->dense_graph(), g->m_wordsize(), g->n());
+    // Reused for all candidates.
+    CyclicDecomposition cycles;
+    std::vector<int> scratch;
+    return search_automorphisms(g->n(), generators, search_budget, [&](const Permutation& p) {
+        p.flat_cyclic_decomposition(&cycles, &scratch);
+        return g->encoded_size(cycles, encoding);
+    });
+}
+
+// The number of powers best_power tries at most.
+static const size_t max_power_candidates = 1024;
+
+Permutation best_power(const NautyGraph& g, const Permutation& automorphism, AdjacencyEncoding encoding) {
+    CyclicDecomposition cycles = automorphism.flat_cyclic_decomposition();
+    // The cycle type of a power g^j only depends on the gcds of j with the cycle
+    // lengths, and j and gcd(j, L), L the lcm of the cycle lengths, give the same
+    // gcds. So the divisors of L are exactly the powers that split the cycles
+    // differently (L itself gives the identity). They are built from the prime
+    // factorization of L, which is the highest power of each prime dividing a
+    // cycle length.
+    std::vector<std::pair<int, int>> factors; // (prime, its exponent in L)
+    for (int i = 0; i < cycles.k(); i++) {
+        int c = cycles.lengths[i];
+        if (i > 0 && c == cycles.lengths[i - 1]) continue; // lengths are sorted
+        for (int p = 2; c > 1; p++) {
+            if (p * p > c) p = c; // c is prime
+            int e = 0;
+            for (; c % p == 0; c /= p) e++;
+            if (e == 0) continue;
+            auto factor = std::find_if(factors.begin(), factors.end(), [p](const auto& f) { return f.first == p; });
+            if (factor == factors.end()) {
+                factors.emplace_back(p, e);
+            } else {
+                factor->second = std::max(factor->second, e);
+            }
+        }
+    }
+    // With many different cycle lengths L has too many divisors to try them all,
+    // then only the first max_power_candidates found (those without large prime
+    // powers first) are tried and the search is a heuristic.
+    std::vector<int> candidates{1};
+    for (const auto& [p, e] : factors) {
+        size_t count = candidates.size();
+        for (size_t i = 0; i < count; i++) {
+            long long j = candidates[i];
+            for (int t = 1; t <= e && candidates.size() < max_power_candidates; t++) {
+                j *= p;
+                if (j > INT_MAX) break;
+                candidates.push_back(j);
+            }
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    CyclicDecomposition powered; // reused for all candidates
+    std::vector<int> scratch;
+    int best_j = 1;
+    size_t best_size = g.encoded_size(cycles, encoding);
+    for (int j : candidates) {
+        if (j == 1) continue;
+        // Powers that are the identity leave nothing to exploit.
+        bool identity = std::all_of(cycles.lengths.begin(), cycles.lengths.end(), [j](int c) { return j % c == 0; });
+        if (identity) continue;
+        cycles.power(j, &powered, &scratch);
+        size_t size = g.encoded_size(powered, encoding);
+        if (size < best_size) {
+            best_j = j;
+            best_size = size;
+        }
+    }
+    return best_j == 1 ? automorphism : automorphism.power(best_j);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "graph.h"
+#include "permutation.h"
+#include <string_view>
+#include <vector>
+
+/**
+ * Computes generators of the automorphism group of a graph with nauty.
+ * @param g The graph, m_wordsize * n setwords.
+ * @param m_wordsize The number of setwords per row.
+ * @param n The number of vertices.
+ * @return The generators nauty reports, empty if the group is trivial.
+ */
+std::vector<Permutation> automorphism_generators(graph* g, int m_wordsize, int n);
+/**
+ * Computes generators of the automorphism group of a sparsegraph with nauty.
+ * @return The generators nauty reports, empty if the group is trivial.
+ */
+std::vector<Permutation> automorphism_generators(sparsegraph* sg);
+/**
+ * Finds an automorphism to encode a graph with, so that no automorphisms
+ * file is needed. nauty computes generators of the automorphism group and
+ * the element giving the shortest encoding is chosen, among the generators
+ * and search_budget further elements of the group built as random products
+ * of the generators (product replacement, after 50 unscored warm-up steps,
+ * so the elements are close to uniformly distributed in the group). Candidates are scored by the exact
+ * length of their encoding, computed without writing it. The search is seeded
+ * the same way for every graph, so the result does not depend on threading.
+ * @param g The graph, nauty runs on it.
+ * @param encoding The adjacency encoding the graph will be encoded with.
+ * @param search_budget The number of random group elements to try.
+ * @return The chosen automorphism, the identity if the group is trivial.
+ */
+Permutation find_automorphism(NautyGraph* g, AdjacencyEncoding encoding, int search_budget);
+
+/**
+ * Chooses the power of an automorphism with the shortest encoding. Powers can
+ * split long cycles into shorter cycles of equal length, whose gcds make the
+ * encoding shorter. The candidates are the powers g^j for the divisors j of
+ * the lcm of the cycle lengths, which are all the ways to split the cycles
+ * (up to 1024 of them; beyond that only a part is tried). They are scored by
+ * the exact length of their encoding, computed from the cycles of the
+ * automorphism without building the power itself.
+ * @param g The graph.
+ * @param automorphism An automorphism of the graph.
+ * @param encoding The adjacency encoding the graph will be encoded with.
+ * @return The power with the shortest encoding, automorphism itself if no power is shorter.
+ */
+Permutation best_power(const NautyGraph& g, const Permutation& automorphism, AdjacencyEncoding encoding);
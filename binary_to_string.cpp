@@ -1,7 +1,6 @@
 #include "binary_to_string.h"
 #include <string>
 #include <cassert>
-#include <vector>
 
 char charify(int n) {
     n = n % 64;
@@ -47,29 +46,34 @@ int log_2_ceil(int n) {
     return log;
 }
 
-std::vector<bool> array_to_bits(int k, const std::vector<int>& array) {
-    assert(k > 0);
-    std::vector<bool> bits;
-    bits.reserve(k * array.size());
-    for (int x : array) {
-        assert(x >= 0 && (x >> k) == 0); // x must fit in k bits
-        for (int i = k - 1; i >= 0; i--) {
-            bits.push_back(x & (1 << i));
-        }
+void BitWriter::flush() {
+    while (m_count >= 6) {
+        m_count -= 6;
+        m_out += char(((m_buffer >> m_count) & 63) + 63);
+    }
+}
+
+void BitWriter::align() {
+    if (m_count % 6 != 0) {
+        write(0, 6 - m_count % 6);
     }
-    return bits;
+    flush();
 }
 
-std::string bits_to_string(const std::vector<bool>& bits) {
-    assert(bits.size() % 6 == 0);
-    std::string out;
-    out.reserve(bits.size() / 6);
-    for (size_t i = 0; i < bits.size(); i += 6) {
-        int n = 0;
-        for (int j = 0; j < 6; j++) {
-            n |= (bits[i + j] << (5 - j));
+void BitReader::refill() {
+    if (m_count <= 16 && m_pos + 8 <= m_data.size()) {
+        // Fast path: eight characters are exactly 48 bits.
+        uint64_t chunk = 0;
+        for (int i = 0; i < 8; i++) {
+            chunk = (chunk << 6) | ((m_data[m_pos + i] - 63) & 63);
         }
-        out += char(n + 63);
+        m_buffer = (m_buffer << 48) | chunk;
+        m_count += 48;
+        m_pos += 8;
+        return;
+    }
+    while (m_count <= 58 && m_pos < m_data.size()) {
+        m_buffer = (m_buffer << 6) | ((m_data[m_pos++] - 63) & 63);
+        m_count += 6;
     }
-    return out;
-}
\ No newline at end of file
+}
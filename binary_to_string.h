@@ -1,7 +1,9 @@
 #pragma once
 
 #include <string>
-#include <vector>
+#include <string_view>
+#include <cstdint>
+#include <cassert>
 
 /**
  * Converts an integer in the range 0-68719476735 to a string representation,
@@ -20,18 +22,99 @@ std::string string_N(int n);
 int log_2_ceil(int n);
 
 /**
- * Converts an array of integers to a vector of bits via concatenation.
- * Each integer is represented in k bits.
- * @param k The number of bits for each integer.
- * @param array The array of integers to convert.
- * @return A vector of bits representing the integers in the array.
+ * Packs bits into the 6-bit printable characters used by McKay's formats,
+ * where each group of 6 bits x is written as char(x + 63).
+ * Bits are collected in a 64-bit register and complete characters are
+ * appended straight to the output string, so no intermediate bit vector
+ * is needed. Call align() once the last bits are written.
  */
-std::vector<bool> array_to_bits(int k, const std::vector<int>& array);
+class BitWriter {
+public:
+    /**
+     * @param out The string to append the characters to. It must outlive the writer.
+     */
+    explicit BitWriter(std::string& out) : m_out(out) {}
+    /**
+     * Writes the k lowest bits of x, most significant bit first.
+     * @param x The value to write, must fit in k bits.
+     * @param k The number of bits to write, at most 32.
+     */
+    void write(uint32_t x, int k) {
+        assert(k >= 0 && k <= 32 && (k == 32 || (x >> k) == 0));
+        if (m_count + k > 64) {
+            flush();
+        }
+        m_buffer = (m_buffer << k) | x;
+        m_count += k;
+    }
+    /**
+     * Writes a single bit.
+     */
+    void write_bit(bool b) {
+        write(b, 1);
+    }
+    /**
+     * Pads the pending bits with 0 up to a multiple of 6 and writes them out,
+     * so that the next write starts at a new character.
+     */
+    void align();
+    /**
+     * @return The number of bits written to the current, incomplete character (0-5).
+     */
+    int partial_bits() const {
+        return m_count % 6;
+    }
+
+private:
+    /** Writes out all complete characters in the register. */
+    void flush();
+
+    std::string& m_out;
+    uint64_t m_buffer = 0; // pending bits are the m_count lowest bits
+    int m_count = 0;
+};
 
 /**
- * Converts a vector of bits to a string representation.
- * Each group of 6 bits is converted to a character by x -> char(x + 63).
- * @param bits The vector of bits to convert, length must be a multiple of 6.
- * @return A string representation of the bits.
+ * Reads bits from a string of 6-bit printable characters (x -> char(x + 63)),
+ * the counterpart of BitWriter. Characters are loaded into a 64-bit buffer,
+ * eight at a time where possible, so reading k bits is a shift and a mask.
  */
-std::string bits_to_string(const std::vector<bool>& bits);
\ No newline at end of file
+class BitReader {
+public:
+    /**
+     * @param data The characters to read. The viewed string must outlive the reader.
+     */
+    explicit BitReader(std::string_view data) : m_data(data) {}
+    /**
+     * Reads the next k bits, most significant bit first.
+     * @param k The number of bits to read, at most 31.
+     * @return The bits read as an integer, or -1 if there are not enough bits left.
+     */
+    int read(int k) {
+        assert(k >= 0 && k <= 31);
+        if (m_count < k) {
+            refill();
+            if (m_count < k) {
+                return -1;
+            }
+        }
+        m_count -= k;
+        return (m_buffer >> m_count) & ((uint64_t(1) << k) - 1);
+    }
+    /**
+     * Skips the remaining bits of the current character, so that the next
+     * read starts at a new character.
+     */
+    void align() {
+        m_count -= m_count % 6;
+    }
+
+private:
+    /** Loads as many characters into the buffer as fit. */
+    void refill();
+
+    std::string_view m_data;
+    size_t m_pos = 0; // next character to load
+    uint64_t m_buffer = 0; // unread bits are the m_count lowest bits
+    int m_count = 0;
+};
@@ -1,141 +1,220 @@
 #include "graph.h"
 #include "permutation.h"
 #include "binary_to_string.h"
+#include "pipeline.h"
+#include "mapped_file.h"
+#include "progress.h"
+#include "automorphism.h"
 #include <iostream>
 #include <stdio.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <cassert>
 #include <algorithm>
 #include <set>
+#include <optional>
 #include "include/nauty/gtools.h"
 #include "include/clipp.h"
 
-std::ifstream input_file;
-std::ifstream automorphisms_file;
 std::ofstream output_file;
 
-void encode_file(const std::string& input_fname, const std::string& automorphisms_fname, const std::string& output_fname, bool progr) {
-    int codetype;
-    bool fswitch = false; // do not assume fixed length lines
-    long startline = 1; // first line (1-based)
-    char* input_fname_cstr = const_cast<char*>(input_fname.c_str());
-    FILE *infile = opengraphfile(input_fname_cstr, &codetype, fswitch, startline);
-    if (infile == NULL) {
+// Number of graphs handed to a worker thread at once.
+const int batch_size = 1024;
+
+struct EncodeBatch {
+    std::vector<std::string_view> graph_lines; // graph6 / sparse6, slices of the mapped input file or of chunks
+    std::vector<std::string_view> automorphism_lines; // empty with auto_automorphism
+    std::vector<LineReader::Chunk> chunks; // the chunks of streamed input the lines are in
+    std::string output; // encoded lines
+    std::string errors; // reported once the batch is written, so they stay in input order
+    long long first_graph = 0; // 0-based index of the first graph of the batch in the input file
+    size_t input_end = 0; // offset in the input file after the last graph line
+    /** Empties the batch to be read into again, keeping the capacity of its buffers. */
+    void clear() {
+        graph_lines.clear();
+        automorphism_lines.clear();
+        chunks.clear();
+        output.clear();
+        errors.clear();
+        first_graph = 0;
+        input_end = 0;
+    }
+};
+
+void encode_file(const std::string& input_fname, const std::string& automorphisms_fname, const std::string& output_fname,
+                 bool auto_automorphism, int search_budget, bool optimize_power, AdjacencyEncoding encoding, bool fallback,
+                 int threads, bool progr) {
+    LineReader input_file(input_fname);
+    if (!input_file.is_open()) {
         std::cerr << "Error opening input file: " << input_fname << std::endl;
         return;
     }
-    automorphisms_file.open(automorphisms_fname);
-    if (!automorphisms_file.is_open()) {
-        std::cerr << "Error opening automorphisms file: " << automorphisms_fname << std::endl;
-        fclose(infile);
-        return;
+    std::optional<LineReader> automorphisms_file; // not needed when nauty finds the automorphisms
+    if (!auto_automorphism) {
+        automorphisms_file.emplace(automorphisms_fname);
+        if (!automorphisms_file->is_open()) {
+            std::cerr << "Error opening automorphisms file: " << automorphisms_fname << std::endl;
+            return;
+        }
     }
     output_file.open(output_fname);
     if (!output_file.is_open()) {
         std::cerr << "Error opening output file: " << output_fname << std::endl;
-        fclose(infile);
-        automorphisms_file.close();
         return;
     }
-    std::string automorphism_line;
-    if (codetype & GRAPH6) {
-        graph *g = NULL; // readg will allocate memory for g
-        int n, m_wordsize;
-        while ((g = readg(infile, g, 0, &m_wordsize, &n)) != NULL) {
-            Graph graphObj = graph_to_Graph(*g, m_wordsize, n);
-            if (!std::getline(automorphisms_file, automorphism_line)) {
+    bool missing_automorphisms = false;
+    long long graphs_read = 0;
+    auto read = [&](EncodeBatch& batch) {
+        batch.first_graph = graphs_read;
+        std::string_view line;
+        while (!missing_automorphisms && (int) batch.graph_lines.size() < batch_size &&
+               input_file.next_line(&line, &batch.chunks)) {
+            if (line.empty()) continue;
+            if (auto_automorphism) {
+                batch.graph_lines.push_back(line);
+                continue;
+            }
+            std::string_view automorphism_line;
+            if (!automorphisms_file->next_line(&automorphism_line, &batch.chunks)) {
                 std::cerr << "Error: Not enough lines in automorphisms file for the number of graphs in input file." << std::endl;
-                FREES(g);
-                fclose(infile);
-                automorphisms_file.close();
-                output_file.close();
-                return;
+                missing_automorphisms = true;
+                break;
             }
-            Permutation automorphism = parse_automorphism(automorphism_line);
-            // non-sparse encoding not implemented
-            output_file << graphObj.encode(automorphism, true) << std::endl;
+            batch.graph_lines.push_back(line);
+            batch.automorphism_lines.push_back(automorphism_line);
         }
-        FREES(g);
-    }
-    else if (codetype & SPARSE6) {
-        sparsegraph *sg = NULL;
-        while ((sg = read_sg(infile, sg)) != NULL) {
-            Graph graphObj = sparsegraph_to_Graph(*sg);
-            if (!std::getline(automorphisms_file, automorphism_line)) {
-                std::cerr << "Error: Not enough lines in automorphisms file for the number of graphs in input file." << std::endl;
-                free(sg->v);
-                free(sg->d);
-                free(sg->e);
-                fclose(infile);
-                automorphisms_file.close();
-                output_file.close();
-                return;
+        batch.input_end = input_file.position();
+        graphs_read += batch.graph_lines.size();
+        return !batch.graph_lines.empty();
+    };
+    auto process = [&](EncodeBatch& batch) {
+        for (size_t i = 0; i < batch.graph_lines.size(); i++) {
+            // Small graph6 graphs are encoded without any allocation per graph.
+            if (!auto_automorphism && !optimize_power &&
+                encode_small(batch.graph_lines[i], batch.automorphism_lines[i], encoding, fallback, &batch.output)) {
+                batch.output += '\n';
+                continue;
+            }
+            // NautyGraph detects graph6 / sparse6 (and the >>graph6<< / >>sparse6<< header) by itself.
+            // The graph is parsed once for finding, scoring and encoding the automorphism.
+            NautyGraph graph(batch.graph_lines[i]);
+            std::optional<Permutation> parsed = auto_automorphism ? find_automorphism(&graph, encoding, search_budget)
+                                                                  : parse_automorphism(batch.automorphism_lines[i], graph.n());
+            if (!parsed) {
+                // The graph is kept as plain graph6 / sparse6, so the output stays aligned with the input.
+                batch.errors += "Error: Invalid automorphism for graph " + std::to_string(batch.first_graph + i + 1) +
+                                ", written without one.\n";
+                std::string_view line = batch.graph_lines[i];
+                strip_nauty_header(&line);
+                batch.output += line;
+                batch.output += '\n';
+                continue;
+            }
+            Permutation automorphism = std::move(*parsed);
+            if (optimize_power) {
+                automorphism = best_power(graph, automorphism, encoding);
+            }
+            if (fallback) {
+                // The plain graph6 / sparse6 string may be written instead, which needs the whole graph.
+                batch.output += graph.to_Graph().encode_shortest(automorphism, encoding);
+            } else {
+                batch.output += graph.encode(automorphism, encoding);
             }
-            Permutation automorphism = parse_automorphism(automorphism_line);
-            output_file << graphObj.encode(automorphism, true) << std::endl;
+            batch.output += '\n';
         }
-        free(sg->v);
-        free(sg->d);
-        free(sg->e);
-    }
+    };
+    ProgressReporter progress("Encoding", input_file.size(), progr);
+    long long graphs_done = 0;
+    auto write = [&](EncodeBatch& batch) {
+        output_file.write(batch.output.data(), batch.output.size());
+        std::cerr << batch.errors;
+        graphs_done += batch.graph_lines.size();
+        progress.update(batch.input_end, graphs_done);
+    };
+    ordered_pipeline<EncodeBatch>(threads, read, process, write);
+    progress.finish();
 
-    fclose(infile);
     output_file.close();
-    automorphisms_file.close();
 }
 
-void decode_file(const std::string& input_fname, const std::string& output_fname, bool sparse, bool progr) {
-    input_file.open(input_fname);
+// Size of the newline-aligned chunks of the encoded file handed to a worker thread at once.
+// Streamed input is also cut where LineReader's chunks end.
+const size_t chunk_size = 1 << 22;
+
+struct DecodeBatch {
+    std::string_view input; // whole lines of the encoded file, a slice of the mapped input file or of a chunk
+    std::vector<LineReader::Chunk> chunks; // the chunk of streamed input the lines are in
+    std::string output; // graph6 / sparse6 lines
+    int graphs = 0;
+    size_t input_end = 0; // offset in the input file after the chunk
+    /** Empties the batch to be read into again, keeping the capacity of its output. */
+    void clear() {
+        input = std::string_view();
+        chunks.clear();
+        output.clear();
+        graphs = 0;
+        input_end = 0;
+    }
+};
+
+void decode_file(const std::string& input_fname, const std::string& output_fname, bool sparse, int threads, bool progr) {
+    LineReader input_file(input_fname);
     if (!input_file.is_open()) {
         std::cerr << "Error opening input file: " << input_fname << std::endl;
         return;
     }
-    int input_graphs_count = 0;
-    std::string line;
-    if (progr) {
-        // Count the number of lines in the input file for progress tracking
-        while (std::getline(input_file, line)) {
-            ++input_graphs_count;
-        }
-        input_file.clear();
-        input_file.seekg(0, std::ios::beg);
-    }
     FILE *out_graphs_file;
     out_graphs_file = fopen(output_fname.c_str(), "w");
-    int progress = 0;
-    if (sparse) {
-        fprintf(out_graphs_file, ">>sparse6<<");
-        while (std::getline(input_file, line)) {
-            printf("\rDecoding graphs %d/%d\r", progress++, input_graphs_count);
-            Graph graphObj = decode(line);
-            sparsegraph s6_graph = graphObj.to_sparsegraph();
-            writes6_sg(out_graphs_file, &s6_graph);
-            free(s6_graph.v);
-            free(s6_graph.d);
-            free(s6_graph.e);
-        }
-        fclose(out_graphs_file);
-        printf("Decoding graphs %d/%d\n", progress, input_graphs_count);
+    if (out_graphs_file == NULL) {
+        std::cerr << "Error opening output file: " << output_fname << std::endl;
+        return;
     }
-    else {
-        fprintf(out_graphs_file, ">>graph6<<");
-        DYNALLSTAT(graph,g,g_sz);
-        while (std::getline(input_file, line)) {
-            printf("\rDecoding graphs %d/%d\r", progress++, input_graphs_count);
-            Graph graphObj = decode(line);
-            int n = graphObj.n();
-            int m_wordsize = SETWORDSNEEDED(n);
-            DYNALLOC2(graph,g,g_sz,m_wordsize,n,"malloc");
-            graphObj.to_densegraph(g, m_wordsize);
-            writeg6(out_graphs_file, g, m_wordsize, n);
+    fprintf(out_graphs_file, sparse ? ">>sparse6<<" : ">>graph6<<");
+    auto read = [&](DecodeBatch& batch) {
+        if (!input_file.next_lines(chunk_size, &batch.input, &batch.chunks)) return false;
+        batch.input_end = input_file.position();
+        return true;
+    };
+    auto process = [&](DecodeBatch& batch) {
+        // Reused for all graphs of the batch, its arrays only grow when a graph does not fit.
+        sparsegraph sg;
+        SG_INIT(sg);
+        size_t position = 0;
+        while (position < batch.input.size()) {
+            std::string_view line = next_line(batch.input, &position);
+            if (!line.empty()) {
+                // Same graphs as writes6_sg / writeg6, but without nauty's static buffers.
+                // Graphs with at most 64 vertices are decoded one word per row.
+                if (decode_small(line, sparse, &batch.output)) {
+                    // written by decode_small
+                } else if (sparse && is_symmetric_encoding(line)) {
+                    decode_to_sparsegraph(line, &sg);
+                    batch.output += to_sparse6(sg);
+                } else if (is_symmetric_encoding(line)) {
+                    batch.output += decode_to_graph6(line);
+                } else {
+                    Graph graphObj = decode(line);
+                    batch.output += sparse ? graphObj.to_sparse6() : graphObj.to_graph6();
+                }
+                batch.output += '\n';
+                batch.graphs++;
+            }
         }
-        DYNFREE(g,g_sz);
-        fclose(out_graphs_file);
-        printf("Decoding graphs %d/%d\n", progress, input_graphs_count);
-    }
+        SG_FREE(sg);
+    };
+    ProgressReporter progress("Decoding", input_file.size(), progr);
+    long long graphs_done = 0;
+    auto write = [&](DecodeBatch& batch) {
+        fwrite(batch.output.data(), 1, batch.output.size(), out_graphs_file);
+        graphs_done += batch.graphs;
+        progress.update(batch.input_end, graphs_done);
+    };
+    ordered_pipeline<DecodeBatch>(threads, read, process, write);
+    fclose(out_graphs_file);
+    progress.finish();
 }
 
 int main(int argc, char *argv[]) {
@@ -144,16 +223,28 @@ int main(int argc, char *argv[]) {
     std::string input_fname;
     std::string automorphisms_fname;
     std::string output_fname;
-    bool progr = false, sparse = true;
+    bool progr = false, sparse = true, fallback = false, auto_automorphism = false, optimize_power = false;
+    int threads = 1;
+    int search_budget = 0;
+    AdjacencyEncoding encoding = AdjacencyEncoding::sparse;
 
     auto input_file = clipp::required("-i", "--input") & clipp::value("input_file", input_fname);
     auto output_file = clipp::required("-o", "--output") & clipp::value("output_file", output_fname);
+    auto threads_option = (clipp::option("-t", "--threads") & clipp::value("threads", threads)) % "number of worker threads";
 
     auto encodeMode = (
         clipp::command("encode").set(selected,mode::encode),
         input_file,
-        clipp::required("-a", "--automorphisms") & clipp::value("automorphisms_file", automorphisms_fname),
+        ((clipp::required("-a", "--automorphisms") & clipp::value("automorphisms_file", automorphisms_fname)) |
+        (clipp::required("--auto-automorphism").set(auto_automorphism) % "find the automorphism of each graph with nauty",
+         (clipp::option("--search") & clipp::value("elements", search_budget)) % "number of random group elements to try per graph")),
+        clipp::option("--optimize-power").set(optimize_power) % "encode with the power of the automorphism giving the shortest encoding",
         output_file,
+        ( clipp::option("-s", "-sparse"  ).set(encoding,AdjacencyEncoding::sparse) |
+        clipp::option("-d", "-dense" ).set(encoding,AdjacencyEncoding::dense) |
+        clipp::option("--auto").set(encoding,AdjacencyEncoding::automatic) ) % "Adjacency is encoded sparse / dense / whichever is shorter",
+        clipp::option("-f", "--fallback").set(fallback) % "write plain graph6 / sparse6 for graphs where it is shorter",
+        threads_option,
         clipp::option("--progress", "-p").set(progr) % "show progress" );
 
     auto decodeMode = (
@@ -162,6 +253,7 @@ int main(int argc, char *argv[]) {
         output_file,
         ( clipp::option("-s", "-sparse"  ).set(sparse,true) |
         clipp::option("-d", "-dense" ).set(sparse,false) ) % "Output format is sparse6 / graph6",
+        threads_option,
         clipp::option("-p", "--progress").set(progr) % "show progress" );
 
     auto cli = (
@@ -170,8 +262,8 @@ int main(int argc, char *argv[]) {
 
     if(clipp::parse(argc, argv, cli)) {
         switch(selected) {
-            case mode::encode: encode_file(input_fname, automorphisms_fname, output_fname, progr); break;
-            case mode::decode: decode_file(input_fname, output_fname, sparse, progr); break;
+            case mode::encode: encode_file(input_fname, automorphisms_fname, output_fname, auto_automorphism, search_budget, optimize_power, encoding, fallback, threads, progr); break;
+            case mode::decode: decode_file(input_fname, output_fname, sparse, threads, progr); break;
             case mode::help: std::cout << clipp::make_man_page(cli, "encoder"); break;
         }
     } else {
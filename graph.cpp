@@ -3,30 +3,42 @@
 #include "binary_to_string.h"
 #include "helpers.h"
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
 #include <sstream>
 #include <algorithm>
 #include <cassert>
 #include <set>
 #include <numeric>
+#include <functional>
+#include <cstdint>
 #include "include/nauty/gtools.h"
 
-Graph::Graph(std::vector<std::vector<int>> neighbors)
-    : m_neighbors{std::move(neighbors)} {
+Graph::Graph(const std::vector<std::vector<int>>& neighbors) {
+    int n = neighbors.size() - 1;
+    m_offsets.resize(n + 2);
+    for (int i = 1; i <= n; i++) {
+        m_offsets[i + 1] = m_offsets[i] + neighbors[i].size();
+    }
+    m_adjacency.reserve(m_offsets[n + 1]);
+    for (int i = 1; i <= n; i++) {
+        m_adjacency.insert(m_adjacency.end(), neighbors[i].begin(), neighbors[i].end());
+    }
+    m_edge_count = m_adjacency.size() / 2;
 }
 
-int Graph::m() const {
-    int edge_count = 0;
-    for (int i = 1; i <= n(); i++) {
-        edge_count += m_neighbors[i].size();
-    }
-    return edge_count / 2; // each edge is counted twice
+Graph::Graph(std::vector<int> offsets, std::vector<int> adjacency)
+    : m_offsets{std::move(offsets)}, m_adjacency{std::move(adjacency)} {
+    assert(m_offsets.size() >= 2 && m_offsets[0] == 0 && m_offsets[1] == 0);
+    assert(m_offsets.back() == (int) m_adjacency.size());
+    m_edge_count = m_adjacency.size() / 2; // each edge is stored twice
 }
 
 std::string Graph::simple_encode() const {
     std::string out = std::to_string(n()) + ":";
     for (int i = 1; i <= n(); i++) {
-        for (int x : m_neighbors[i]) {
+        for (int x : neighbors(i)) {
             out += std::to_string(x) + ",";
         }
         out += ";";
@@ -34,10 +46,10 @@ std::string Graph::simple_encode() const {
     return out;
 }
 
-Graph simple_decode(const std::string& encoded) {
+Graph simple_decode(std::string_view encoded) {
     std::vector<std::vector<int>> neighbors;
-    int n; // number of vertices
-    sscanf(encoded.c_str(), "%d:", &n);
+    int n = 0; // number of vertices
+    std::from_chars(encoded.data(), encoded.data() + encoded.size(), n);
     neighbors.resize(n + 1); // padded to use 1-based indexing
     int spos = encoded.find(":") + 1; // position in string
     for (int i = 1; i <= n; i++) {
@@ -46,67 +58,94 @@ Graph simple_decode(const std::string& encoded) {
     return Graph(neighbors);
 }
 
-Graph graph_to_Graph(const graph& g, int m_wordsize, int n) {
-    std::vector<std::vector<int>> neighbors(n + 1); // padded to use 1-based indexing
+Graph graph_to_Graph(const graph* g, int m_wordsize, int n) {
+    // Rows of a dense graph hold the full neighborhood, so each row is read
+    // a word at a time: once to count the neighbors, once to list them.
+    std::vector<int> offsets(n + 2); // padded to use 1-based indexing
     for (int u = 0; u < n; u++) {
-        for (int v = u; v < n; v++) {
-            if (ISELEMENT(GRAPHROW(g, u, m_wordsize), v)) {
-                neighbors[u + 1].push_back(v + 1); // Convert to 1-based indexing
-                if (u != v) {
-                    neighbors[v + 1].push_back(u + 1);
-                }
+        const set* row = GRAPHROW(g, u, m_wordsize);
+        int degree = 0;
+        for (int w = 0; w < m_wordsize; w++) {
+            degree += POPCOUNT(row[w]);
+        }
+        offsets[u + 2] = offsets[u + 1] + degree;
+    }
+    std::vector<int> adjacency(offsets[n + 1]);
+    size_t epos = 0;
+    for (int u = 0; u < n; u++) {
+        const set* row = GRAPHROW(g, u, m_wordsize);
+        for (int w = 0; w < m_wordsize; w++) {
+            setword word = row[w];
+            while (word) {
+                int b;
+                TAKEBIT(b, word);
+                adjacency[epos++] = w * WORDSIZE + b + 1; // Convert to 1-based indexing
             }
         }
     }
-    return Graph(neighbors);
+    return Graph(std::move(offsets), std::move(adjacency));
 }
 
-Graph nauty_decode_dense(const std::string& encoded) {
-    char* encoded_cstr = new char[encoded.size() + 1];
-    strcpy(encoded_cstr, encoded.c_str());
+Graph nauty_decode_dense(std::string_view encoded) {
+    // nauty expects a null-terminated string, which a slice of a larger buffer is not.
+    std::string encoded_str(encoded);
+    char* encoded_cstr = encoded_str.data();
     int n = graphsize(encoded_cstr);
-    DYNALLSTAT(graph,g,g_sz);
     int m = SETWORDSNEEDED(n);
-    DYNALLOC2(graph,g,g_sz,m,n,"malloc");
-    stringtograph(encoded_cstr, g, m);
-    Graph graph1 = graph_to_Graph(*g, m, n);
-    DYNFREE(g, g_sz);
-    delete[] encoded_cstr;
+    // A local buffer rather than DYNALLSTAT, which is static and so not safe to use from several threads.
+    std::vector<graph> g((size_t) m * n);
+    stringtograph(encoded_cstr, g.data(), m);
+    Graph graph1 = graph_to_Graph(g.data(), m, n);
     return graph1;
 }
 
 Graph sparsegraph_to_Graph(const sparsegraph& sg) {
-    std::vector<std::vector<int>> neighbors(sg.nv + 1); // padded to use 1-based indexing
+    std::vector<int> offsets(sg.nv + 2); // padded to use 1-based indexing
+    for (int u = 0; u < sg.nv; u++) {
+        offsets[u + 2] = offsets[u + 1] + sg.d[u];
+    }
+    std::vector<int> adjacency(offsets[sg.nv + 1]);
+    size_t epos = 0;
     for (int u = 0; u < sg.nv; u++) {
         for (int i = 0; i < sg.d[u]; i++) {
-            int v = sg.e[sg.v[u] + i];
-            neighbors[u + 1].push_back(v + 1); // Convert to 1-based indexing
+            adjacency[epos++] = sg.e[sg.v[u] + i] + 1; // Convert to 1-based indexing
         }
     }
-    return Graph(neighbors);
+    return Graph(std::move(offsets), std::move(adjacency));
 }
 
-Graph nauty_decode_sparse(const std::string& encoded) {
+Graph nauty_decode_sparse(std::string_view encoded) {
     sparsegraph sg;
-    char* encoded_cstr = new char[encoded.size() + 1];
-    strcpy(encoded_cstr, encoded.c_str());
-    stringtosparsegraph(encoded_cstr, &sg, NULL);
+    SG_INIT(sg);
+    int loops;
+    // nauty expects a null-terminated string, which a slice of a larger buffer is not.
+    std::string encoded_str(encoded);
+    char* encoded_cstr = encoded_str.data();
+    stringtosparsegraph(encoded_cstr, &sg, &loops);
     Graph graph1 = sparsegraph_to_Graph(sg);
     free(sg.v);
     free(sg.d);
     free(sg.e);
-    delete[] encoded_cstr;
     return graph1;
 }
 
-Graph nauty_decode(const std::string& encoded) {
-    if (encoded.find(">>graph6<<") == 0) {
-        return nauty_decode_dense(encoded.substr(10)); // Remove the ">>graph6<<" prefix
-    } else if (encoded.find(">>sparse6<<") == 0) {
-        return nauty_decode_sparse(encoded.substr(11)); // Remove the ">>sparse6<<" prefix
-    } else if (encoded[0] == ':') { // sparse6 always starts with ':'
+bool strip_nauty_header(std::string_view* encoded) {
+    if (encoded->substr(0, 10) == ">>graph6<<") {
+        encoded->remove_prefix(10);
+        return false;
+    } else if (encoded->substr(0, 11) == ">>sparse6<<") {
+        encoded->remove_prefix(11);
+        return true;
+    }
+    // sparse6 always starts with ':'. graph6 does not have a fixed prefix,
+    // but it cannot start with ':' since that is reserved for sparse6.
+    return !encoded->empty() && (*encoded)[0] == ':';
+}
+
+Graph nauty_decode(std::string_view encoded) {
+    if (strip_nauty_header(&encoded)) {
         return nauty_decode_sparse(encoded);
-    } else { // graph6 does not have a fixed prefix, but it cannot start with ':' since that is reserved for sparse6
+    } else {
         return nauty_decode_dense(encoded);
     }
 }
@@ -114,10 +153,10 @@ Graph nauty_decode(const std::string& encoded) {
 bool Graph::operator==(const Graph& other) const {
     if (n() != other.n()) return false;
     for (int i = 1; i <= n(); i++) {
-        if (neighbors()[i].size() != other.neighbors()[i].size()) return false;
+        if (neighbors(i).size() != other.neighbors(i).size()) return false;
         // Only works for simple graphs.
-        std::set<int> set1(neighbors()[i].begin(), neighbors()[i].end());
-        for (int n2 : other.neighbors()[i]) {
+        std::set<int> set1(neighbors(i).begin(), neighbors(i).end());
+        for (int n2 : other.neighbors(i)) {
             if (set1.count(n2) == 0) {
                 return false;
             }
@@ -126,98 +165,220 @@ bool Graph::operator==(const Graph& other) const {
     return true;
 }
 
-std::string Graph::encode_dense_adjacency(const std::vector<std::vector<int>>& cyclic_decomposition) const {
-    std::string out = "";
-    int k = cyclic_decomposition.size();
-    for (int j = 0; j < k; j++) {
-        for (int i = 0; i <= j; i++) {
-            // Take the first node of the i-th cycle / orbit and compute the 
-            // edges to the j-th cycle.
-            int source = cyclic_decomposition[i][0];
-            std::set<int> source_neighbors(neighbors()[source].begin(), neighbors()[source].end());
-            int m = std::gcd(cyclic_decomposition[i].size(), cyclic_decomposition[j].size());
-            int target_i = 0;
-            std::set<int> deltas;
-            for (int target : cyclic_decomposition[j]) {
-                if (source_neighbors.count(target) > 0) {
-                    deltas.insert(target_i % m);
-                }
-                target_i++;
-            }
-            bool first = true;
-            for (int delta : deltas) {
-                if (!first) out += ",";
-                first = false;
-                out += std::to_string(delta);
-            }
-            out += ";";
+/**
+ * The gcds of pairs of cycle lengths, which give the number of deltas of an
+ * edge of the quotient graph, and their bit widths. When all cycles have the
+ * same length c (the automorphism is semiregular, as for vertex-transitive and
+ * Cayley graphs) every gcd is c, so it and log_2_ceil(c) are computed once
+ * instead of for every pair of cycles.
+ */
+class CycleGcds {
+public:
+    /**
+     * @param lengths The cycle lengths in descending order.
+     * @param k The number of cycles.
+     */
+    CycleGcds(const int* lengths, int k)
+        : m_lengths(lengths), m_semiregular(k == 0 || lengths[0] == lengths[k - 1]),
+          m_c(k == 0 ? 1 : lengths[0]), m_bits(log_2_ceil(m_c)) {}
+    /** @return Whether all cycles have the same length. */
+    bool semiregular() const { return m_semiregular; }
+    /** @return gcd of the lengths of the cycles i and j (0-based). */
+    int gcd(int i, int j) const { return m_semiregular ? m_c : std::gcd(m_lengths[i], m_lengths[j]); }
+    /** @return log_2_ceil(gcd(i, j)), the width of a delta between the cycles i and j (0-based). */
+    int bits(int i, int j) const { return m_semiregular ? m_bits : log_2_ceil(gcd(i, j)); }
+
+private:
+    const int* m_lengths;
+    bool m_semiregular;
+    int m_c;
+    int m_bits;
+};
+
+/**
+ * Computes the delta sets of the quotient graph by walking only the
+ * neighbors of the first vertex of each cycle.
+ * @param n The number of vertices of the graph.
+ * @param visit_neighbors Callable void(int v, F f) that calls f(u) for every
+ *                        neighbor u of the vertex v (both 1-based).
+ * @return Sorted triples (i, j, delta) with j <= i, one for every delta
+ *         of the edge between the i-th and j-th cycle (1-based).
+ */
+template <typename VisitNeighbors>
+static std::vector<std::tuple<int, int, int>> quotient_deltas(int n, const CyclicDecomposition& cyclic_decomposition,
+                                                              VisitNeighbors visit_neighbors) {
+    int k = cyclic_decomposition.k();
+    // Inverse of the cyclic decomposition: the (1-based) orbit of each vertex
+    // and its index within the cycle of that orbit.
+    std::vector<int> orbit_of(n + 1);
+    std::vector<int> position_of(n + 1);
+    for (int i = 0; i < k; i++) {
+        for (int p = 0; p < cyclic_decomposition.lengths[i]; p++) {
+            orbit_of[cyclic_decomposition.at(i, p)] = i + 1;
+            position_of[cyclic_decomposition.at(i, p)] = p;
         }
     }
-    return out;
+    CycleGcds gcds(cyclic_decomposition.lengths.data(), k);
+    std::vector<std::tuple<int, int, int>> deltas; // (source orbit i, target orbit j, delta)
+    for (int i = 1; i <= k; i++) {
+        // Take the first node of the i-th cycle / orbit; its neighbors
+        // determine all edges from the i-th orbit to the orbits j <= i.
+        int source = cyclic_decomposition.at(i-1, 0);
+        size_t first = deltas.size();
+        if (gcds.semiregular()) {
+            // Every gcd is the cycle length, so the positions are the deltas.
+            visit_neighbors(source, [&](int target) {
+                int j = orbit_of[target];
+                if (j <= i) deltas.emplace_back(i, j, position_of[target]);
+            });
+        } else {
+            visit_neighbors(source, [&](int target) {
+                int j = orbit_of[target];
+                if (j > i) return;
+                deltas.emplace_back(i, j, position_of[target] % gcds.gcd(i-1, j-1));
+            });
+        }
+        std::sort(deltas.begin() + first, deltas.end());
+        deltas.erase(std::unique(deltas.begin() + first, deltas.end()), deltas.end());
+    }
+    return deltas;
 }
 
-std::string Graph::encode_sparse_adjacency(const std::vector<std::vector<int>>& cyclic_decomposition) const {
-    std::string out = "";
-    int k = cyclic_decomposition.size();
-    std::vector<bool> edges_bits;
-    int v = 1; // current position as a vertex in the quotient graph (that is cycle in the cyclic decomposition)
-    int b_k = log_2_ceil(k);
+static void encode_dense_adjacency(const CyclicDecomposition& cyclic_decomposition,
+                                   const std::vector<std::tuple<int, int, int>>& deltas, BitWriter& writer) {
+    int k = cyclic_decomposition.k();
+    auto write_zeros = [&writer](int count) {
+        for (; count > 0; count -= 32) {
+            writer.write(0, std::min(count, 32));
+        }
+    };
+    // The dense adjacency representation is a bitmap of m_ij = gcd(size of cycle i, size of cycle j)
+    // bits for every edge (i, j), j <= i, of the quotient graph, in the same order as the sparse
+    // instructions. Bit x of the bitmap is set if x is a delta of that edge.
+    CycleGcds gcds(cyclic_decomposition.lengths.data(), k);
+    size_t l = 0;
     for (int i = 1; i <= k; i++) {
         for (int j = 1; j <= i; j++) {
-            int source = cyclic_decomposition[i-1][0];
-            int m = std::gcd(cyclic_decomposition[i-1].size(), cyclic_decomposition[j-1].size());
-            std::set<int> deltas;
-            int target_i = 0;
-            for (int target : cyclic_decomposition[j-1]) {
-                if (std::find(neighbors()[source].begin(), neighbors()[source].end(), target) != neighbors()[source].end()) {
-                    deltas.insert(target_i % m);
-                }
-                target_i++;
-            }
-            // The sparse adjacency representation is a sequence of bits
-            // f_0 x_0 f_1 x_1 ..., where f_i is a bit, and if
-            // f_i = 0, then x_i is b_k bits long, where b_k = log_2_ceil(# of cycles in automorphism)
-            // If x_i > v then update v to x_i, otherwise select the edge (v, x_i).
-            // f_i = 1, then x_i is b_ij bits long, where b_ij = log_2_ceil(gcd(size of cycle i, size of cycle j)),
-            // and (i, j) is the selected edge. x_i is then a delta of this edge in the quotient graph.
-            if (!deltas.empty()) {
-                if (v != i) {
-                    // move the current position to the source cycle
-                    edges_bits.push_back(0);
-                    for (int l = b_k - 1; l >= 0; l--) {
-                        edges_bits.push_back(i & (1 << l));
-                    }
-                    v = i;
-                }
-                // Now that v is correct, add the edge to the target cycle.
-                edges_bits.push_back(0);
-                for (int l = b_k - 1; l >= 0; l--) {
-                    edges_bits.push_back(j & (1 << l));
-                }
-                int b_ij = log_2_ceil(m);
-                for (int delta : deltas) {
-                    edges_bits.push_back(1);
-                    for (int l = b_ij - 1; l >= 0; l--) {
-                        edges_bits.push_back(delta & (1 << l));
-                    }
-                }
+            int m = gcds.gcd(i-1, j-1);
+            int x = 0; // next bit of the bitmap
+            for (; l < deltas.size() && std::get<0>(deltas[l]) == i && std::get<1>(deltas[l]) == j; l++) {
+                int delta = std::get<2>(deltas[l]);
+                write_zeros(delta - x);
+                writer.write_bit(1);
+                x = delta + 1;
             }
+            write_zeros(m - x);
+        }
+    }
+    writer.align();
+}
+
+static void encode_sparse_adjacency(const CyclicDecomposition& cyclic_decomposition,
+                                    const std::vector<std::tuple<int, int, int>>& deltas, BitWriter& writer) {
+    int k = cyclic_decomposition.k();
+    int v = 1; // current position as a vertex in the quotient graph (that is cycle in the cyclic decomposition)
+    int u = -1; // currently selected edge (v, u) of the quotient graph
+    int b_k = log_2_ceil(k);
+    int b_ij = 1;
+    CycleGcds gcds(cyclic_decomposition.lengths.data(), k);
+    // The sparse adjacency representation is a sequence of bits
+    // f_0 x_0 f_1 x_1 ..., where f_i is a bit, and if
+    // f_i = 0, then x_i is b_k bits long, where b_k = log_2_ceil(# of cycles in automorphism)
+    // If x_i > v then update v to x_i, otherwise select the edge (v, x_i).
+    // f_i = 1, then x_i is b_ij bits long, where b_ij = log_2_ceil(gcd(size of cycle i, size of cycle j)),
+    // and (i, j) is the selected edge. x_i is then a delta of this edge in the quotient graph.
+    for (const auto& [i, j, delta] : deltas) {
+        if (v != i) {
+            // move the current position to the source cycle
+            writer.write_bit(0);
+            writer.write(i, b_k);
+            v = i;
+            u = -1;
         }
+        if (u != j) {
+            // Now that v is correct, add the edge to the target cycle.
+            writer.write_bit(0);
+            writer.write(j, b_k);
+            u = j;
+            b_ij = gcds.bits(i-1, j-1);
+        }
+        writer.write_bit(1);
+        writer.write(delta, b_ij);
     }
     // We can always pad with 0 because f_i = 0 and x_i = 0 is not a valid
     // instruction since vertices are in the range [1, k].
-    if (edges_bits.size() % 6 != 0) {
-        int padding = 6 - (edges_bits.size() % 6);
-        edges_bits.resize(edges_bits.size() + padding, false);
+    writer.align();
+}
+
+/**
+ * Computes the exact length of the sparse adjacency stream written by
+ * encode_sparse_adjacency, before padding.
+ */
+static size_t sparse_adjacency_bits(const CyclicDecomposition& cyclic_decomposition,
+                                    const std::vector<std::tuple<int, int, int>>& deltas) {
+    int b_k = log_2_ceil(cyclic_decomposition.k());
+    CycleGcds gcds(cyclic_decomposition.lengths.data(), cyclic_decomposition.k());
+    int v = 1;
+    int u = -1;
+    int b_ij = 1;
+    size_t bits = 0;
+    for (const auto& [i, j, delta] : deltas) {
+        if (v != i) {
+            bits += 1 + b_k;
+            v = i;
+            u = -1;
+        }
+        if (u != j) {
+            bits += 1 + b_k;
+            u = j;
+            b_ij = gcds.bits(i-1, j-1);
+        }
+        bits += 1 + b_ij;
     }
-    out += bits_to_string(edges_bits);
-    return out;
+    return bits;
+}
+
+/**
+ * Computes the exact length of the dense adjacency bitmaps written by
+ * encode_dense_adjacency, before padding. Only depends on the cycle
+ * sizes, given as (number of cycles, size of those cycles) groups.
+ */
+static size_t dense_adjacency_bits(const std::vector<std::tuple<int, int>>& cycle_sizes) {
+    size_t bits = 0;
+    for (size_t a = 0; a < cycle_sizes.size(); a++) {
+        const auto& [count_a, size_a] = cycle_sizes[a];
+        // Pairs of cycles within the group, including a cycle with itself.
+        bits += (size_t) count_a * (count_a + 1) / 2 * size_a;
+        for (size_t b = 0; b < a; b++) {
+            const auto& [count_b, size_b] = cycle_sizes[b];
+            bits += (size_t) count_a * count_b * std::gcd(size_a, size_b);
+        }
+    }
+    return bits;
 }
 
-std::string Graph::encode(const Permutation& automorphism, bool sparse) const {
-    std::vector<std::vector<int>> cyclic_decomposition = automorphism.cyclic_decomposition();
-    std::string out = "::" + string_N(n());
-    int k = cyclic_decomposition.size();
+/**
+ * Everything needed to write the encoding of a graph with a given
+ * automorphism, including its exact length.
+ */
+struct EncodingPlan {
+    std::vector<std::tuple<int, int>> cycle_sizes; // (number of cycles, size of those cycles)
+    std::vector<std::tuple<int, int, int>> deltas; // see quotient_deltas
+    bool sparse; // adjacency encoding, automatic is resolved
+    size_t size; // length of the encoded string
+};
+
+/**
+ * Computes the cycle type and the deltas of a graph with the given automorphism
+ * and from them the exact length of its encoding, without writing it.
+ * The graph is only accessed through the neighbors of the first vertex of each cycle.
+ * @param n The number of vertices of the graph.
+ * @param visit_neighbors See quotient_deltas.
+ */
+template <typename VisitNeighbors>
+static EncodingPlan plan_encoding(int n, const CyclicDecomposition& cyclic_decomposition, AdjacencyEncoding encoding,
+                                  VisitNeighbors visit_neighbors) {
+    int k = cyclic_decomposition.k();
     std::vector<std::tuple<int, int>> cycle_sizes; // (number of cycles, size of those cycles)
     cycle_sizes.reserve(k);
     int counter = 0;
@@ -225,10 +386,10 @@ std::string Graph::encode(const Permutation& automorphism, bool sparse) const {
     int single_cycles = 0;
     for (int i = 0; i < k; i++) {
         counter++;
-        if (i != k-1 && cyclic_decomposition[i].size() == cyclic_decomposition[i+1].size()) {
+        if (i != k-1 && cyclic_decomposition.lengths[i] == cyclic_decomposition.lengths[i+1]) {
             continue;
         } else {
-            cycle_sizes.emplace_back(counter, cyclic_decomposition[i].size());
+            cycle_sizes.emplace_back(counter, cyclic_decomposition.lengths[i]);
             if (counter > 1) {
                 multi_cycles++;
             } else {
@@ -243,67 +404,210 @@ std::string Graph::encode(const Permutation& automorphism, bool sparse) const {
     // where each number is b_n = log_2_ceil(n) bits long. A pairs (f_i, c_i)
     // means that there are f_i cycles with length c_i, 
     // while d_i means that there is a single cycle of length d_i.
-    int b_n = log_2_ceil(n());
-    std::vector<int> cycle_sizes_encoded;
-    cycle_sizes_encoded.reserve(2 + 2 * multi_cycles + single_cycles);
-    int i;
-    for (i = 0; i < multi_cycles; i++) {
-        cycle_sizes_encoded.push_back(std::get<0>(cycle_sizes[i])); // numer of cycles of that size
-        cycle_sizes_encoded.push_back(std::get<1>(cycle_sizes[i])); // size of those cycles
-    }
-    cycle_sizes_encoded.push_back(0);
-    for (; i < (int) cycle_sizes.size(); i++) {
-        cycle_sizes_encoded.push_back(std::get<1>(cycle_sizes[i])); // size of the single cycle
-    }
-    cycle_sizes_encoded.push_back(0);
-    std::vector<bool> cycle_sizes_bits = array_to_bits(b_n, cycle_sizes_encoded);
-    if (cycle_sizes_bits.size() % 6 != 0) {
-        int padding = 6 - (cycle_sizes_bits.size() % 6);
-        cycle_sizes_bits.resize(cycle_sizes_bits.size() + padding, false);
-    }
-    out += bits_to_string(cycle_sizes_bits);
-    if (sparse) {
-        out += encode_sparse_adjacency(cyclic_decomposition);
+    // Both lists keep the descending order of the cyclic decomposition.
+    int b_n = log_2_ceil(n);
+    int header_bits = b_n * (2 + 2 * multi_cycles + single_cycles);
+    std::vector<std::tuple<int, int, int>> deltas = quotient_deltas(n, cyclic_decomposition, visit_neighbors);
+    // Both adjacency encodings can be sized exactly from the deltas, so only the shorter one is written.
+    size_t sparse_chars = 0, dense_chars = 0;
+    if (encoding != AdjacencyEncoding::dense) {
+        sparse_chars = (sparse_adjacency_bits(cyclic_decomposition, deltas) + 5) / 6;
+    }
+    if (encoding != AdjacencyEncoding::sparse) {
+        dense_chars = (dense_adjacency_bits(cycle_sizes) + 5) / 6;
+    }
+    if (encoding == AdjacencyEncoding::automatic) {
+        encoding = dense_chars < sparse_chars ? AdjacencyEncoding::dense : AdjacencyEncoding::sparse;
+    }
+    bool sparse = encoding == AdjacencyEncoding::sparse;
+    size_t encoded_size = 2 + string_N(n).size() + (header_bits + 5) / 6 + (sparse ? sparse_chars : dense_chars);
+    return EncodingPlan{std::move(cycle_sizes), std::move(deltas), sparse, encoded_size};
+}
+
+/**
+ * Encodes a graph with the given automorphism, see Graph::encode and plan_encoding.
+ */
+template <typename VisitNeighbors>
+static std::string encode_symmetric(int n, const Permutation& automorphism, AdjacencyEncoding encoding,
+                                    VisitNeighbors visit_neighbors) {
+    // Kept per thread, so encoding a stream of graphs does not allocate them per graph.
+    static thread_local CyclicDecomposition cyclic_decomposition;
+    static thread_local std::vector<int> scratch;
+    automorphism.flat_cyclic_decomposition(&cyclic_decomposition, &scratch);
+    EncodingPlan plan = plan_encoding(n, cyclic_decomposition, encoding, visit_neighbors);
+    std::string out = (plan.sparse ? "::" : ":;") + string_N(n);
+    out.reserve(plan.size);
+    BitWriter writer(out);
+    int b_n = log_2_ceil(n);
+    // The cycle sizes, see plan_encoding.
+    for (const auto& [count, size] : plan.cycle_sizes) {
+        if (count > 1) {
+            writer.write(count, b_n); // number of cycles of that size
+            writer.write(size, b_n); // size of those cycles
+        }
+    }
+    writer.write(0, b_n);
+    for (const auto& [count, size] : plan.cycle_sizes) {
+        if (count == 1) {
+            writer.write(size, b_n); // size of the single cycle
+        }
+    }
+    writer.write(0, b_n);
+    writer.align();
+    if (plan.sparse) {
+        encode_sparse_adjacency(cyclic_decomposition, plan.deltas, writer);
     }
     else {
-        assert(false && "Dense encoding is not implemented yet.");
-        out += encode_dense_adjacency(cyclic_decomposition);
+        encode_dense_adjacency(cyclic_decomposition, plan.deltas, writer);
     }
+    assert(out.size() == plan.size);
     return out;
 }
 
-Graph decode(const std::string& encoded) {
-    assert(encoded.find("::") == 0); // The encoded string must start with "::"
-    int n; // n = number of vertices
-    int s_pos = 2; // string (encoded) position
-    if (encoded[s_pos] == 126 && encoded[s_pos + 1] == 126) {
-        n = ((encoded[s_pos + 2] - 63) << 30) +
-            ((encoded[s_pos + 3] - 63) << 24) +
-            ((encoded[s_pos + 4] - 63) << 18) +
-            ((encoded[s_pos + 5] - 63) << 12) +
-            ((encoded[s_pos + 6] - 63) << 6) +
-            (encoded[s_pos + 7] - 63);
-        s_pos = s_pos + 8; // Move past the n value
-    }
-    else if (encoded[s_pos] == 126) {
-        n = ((encoded[s_pos + 1] - 63) << 12) +
-            ((encoded[s_pos + 2] - 63) << 6) +
-            (encoded[s_pos + 3] - 63);
-        s_pos += 4; // Move past the n value
+std::string Graph::encode(const Permutation& automorphism, AdjacencyEncoding encoding) const {
+    return encode_symmetric(n(), automorphism, encoding, [this](int v, auto&& f) {
+        for (int u : neighbors(v)) f(u);
+    });
+}
+
+/**
+ * @return A neighbor visitor (see quotient_deltas) reading the rows of a dense nauty graph.
+ */
+static auto dense_neighbors(const graph* g, int m_wordsize) {
+    return [g, m_wordsize](int v, auto&& f) {
+        const set* row = GRAPHROW(g, v - 1, m_wordsize);
+        for (int w = 0; w < m_wordsize; w++) {
+            setword word = row[w];
+            while (word) {
+                int b;
+                TAKEBIT(b, word);
+                f(w * WORDSIZE + b + 1); // Convert to 1-based indexing
+            }
+        }
+    };
+}
+
+/**
+ * @return A neighbor visitor (see quotient_deltas) reading a sparsegraph.
+ */
+static auto sparse_neighbors(const sparsegraph& sg) {
+    return [&sg](int v, auto&& f) {
+        for (int i = 0; i < sg.d[v - 1]; i++) {
+            f(sg.e[sg.v[v - 1] + i] + 1); // Convert to 1-based indexing
+        }
+    };
+}
+
+std::string encode(const graph* g, int m_wordsize, int n, const Permutation& automorphism, AdjacencyEncoding encoding) {
+    return encode_symmetric(n, automorphism, encoding, dense_neighbors(g, m_wordsize));
+}
+
+std::string encode(const sparsegraph& sg, const Permutation& automorphism, AdjacencyEncoding encoding) {
+    return encode_symmetric(sg.nv, automorphism, encoding, sparse_neighbors(sg));
+}
+
+size_t encoded_size(const graph* g, int m_wordsize, int n, const CyclicDecomposition& cycles, AdjacencyEncoding encoding) {
+    return plan_encoding(n, cycles, encoding, dense_neighbors(g, m_wordsize)).size;
+}
+
+size_t encoded_size(const sparsegraph& sg, const CyclicDecomposition& cycles, AdjacencyEncoding encoding) {
+    return plan_encoding(sg.nv, cycles, encoding, sparse_neighbors(sg)).size;
+}
+
+NautyGraph::NautyGraph(std::string_view str) {
+    m_sparse = strip_nauty_header(&str);
+    // nauty expects a null-terminated string, which a slice of a larger buffer is not.
+    std::string encoded_str(str);
+    char* encoded_cstr = encoded_str.data();
+    SG_INIT(m_sg);
+    if (m_sparse) {
+        int loops;
+        stringtosparsegraph(encoded_cstr, &m_sg, &loops);
+        m_n = m_sg.nv;
+    } else {
+        m_n = graphsize(encoded_cstr);
+        m_m = SETWORDSNEEDED(m_n);
+        m_g.resize((size_t) m_m * m_n);
+        stringtograph(encoded_cstr, m_g.data(), m_m);
+    }
+}
+
+NautyGraph::~NautyGraph() {
+    SG_FREE(m_sg);
+}
+
+std::string NautyGraph::encode(const Permutation& automorphism, AdjacencyEncoding encoding) const {
+    return m_sparse ? ::encode(m_sg, automorphism, encoding) : ::encode(m_g.data(), m_m, m_n, automorphism, encoding);
+}
+
+size_t NautyGraph::encoded_size(const CyclicDecomposition& cycles, AdjacencyEncoding encoding) const {
+    return m_sparse ? ::encoded_size(m_sg, cycles, encoding) : ::encoded_size(m_g.data(), m_m, m_n, cycles, encoding);
+}
+
+Graph NautyGraph::to_Graph() const {
+    return m_sparse ? sparsegraph_to_Graph(m_sg) : graph_to_Graph(m_g.data(), m_m, m_n);
+}
+
+std::string nauty_encode(std::string_view encoded, const Permutation& automorphism, AdjacencyEncoding encoding) {
+    return NautyGraph(encoded).encode(automorphism, encoding);
+}
+
+/**
+ * The content of an automorphism based encoding.
+ */
+struct SymmetricDescription {
+    int n; // number of vertices
+    std::vector<int> cycle_sizes; // in descending order, as in the cyclic decomposition
+    std::vector<int> index_starts; // cumulative sum of the sizes of the cycles, k + 1 entries
+    std::vector<std::tuple<int, int, int>> deltas; // (v, u, delta) with v >= u, 1-based cycles
+};
+
+/**
+ * Reads the number of vertices N(n) written by string_N.
+ * @param encoded The string containing N(n).
+ * @param s_pos The position of N(n), moved past it.
+ * @return The number of vertices.
+ */
+static int parse_N(std::string_view encoded, int* s_pos) {
+    int n;
+    int pos = *s_pos;
+    if (encoded[pos] == 126 && encoded[pos + 1] == 126) {
+        n = ((encoded[pos + 2] - 63) << 30) +
+            ((encoded[pos + 3] - 63) << 24) +
+            ((encoded[pos + 4] - 63) << 18) +
+            ((encoded[pos + 5] - 63) << 12) +
+            ((encoded[pos + 6] - 63) << 6) +
+            (encoded[pos + 7] - 63);
+        *s_pos += 8; // Move past the n value
+    }
+    else if (encoded[pos] == 126) {
+        n = ((encoded[pos + 1] - 63) << 12) +
+            ((encoded[pos + 2] - 63) << 6) +
+            (encoded[pos + 3] - 63);
+        *s_pos += 4; // Move past the n value
     }
     else {
-        n = int(encoded[s_pos] - 63);
-        s_pos += 1; // Move past the n value
+        n = int(encoded[pos] - 63);
+        *s_pos += 1; // Move past the n value
     }
+    return n;
+}
+
+static SymmetricDescription parse_symmetric(std::string_view encoded) {
+    // The encoded string must start with "::" (sparse adjacency) or ":;" (dense adjacency)
+    assert(encoded.size() >= 2 && encoded[0] == ':' && (encoded[1] == ':' || encoded[1] == ';'));
+    bool dense = encoded[1] == ';';
+    int s_pos = 2; // string (encoded) position
+    int n = parse_N(encoded, &s_pos); // n = number of vertices
 
     std::vector<int> cycle_sizes;
-    std::tuple<int, int> pos(s_pos, 0); // position in the string and bit position within the character
+    BitReader reader(encoded.substr(s_pos));
     int b_n = log_2_ceil(n);
     int factor = -1;
     int cycle_size = -1;
     bool multi_cycles = true;
     while (1) {
-        int x = read_k_bits(encoded, b_n, pos);
+        int x = reader.read(b_n);
         assert(x != -1);
         if (x == 0 && multi_cycles == true) {
             multi_cycles = false; // No more multi-cycles, now single cycles
@@ -328,112 +632,363 @@ Graph decode(const std::string& encoded) {
             cycle_sizes.push_back(x);
         }
     }
-    if (std::get<1>(pos) > 0) {
-        s_pos = std::get<0>(pos) + 1; // Move past the last character
-    }
-    else {
-        s_pos = std::get<0>(pos); // No need to move, we are at the end of the string
-    }
+    reader.align(); // The deltas start at a new character
+    // Multi-cycles and single cycles are stored separately, but the cyclic
+    // decomposition (and therefore the vertex order) sorts all cycles by size.
+    std::sort(cycle_sizes.begin(), cycle_sizes.end(), std::greater<int>());
     int k = cycle_sizes.size();
+    CycleGcds gcds(cycle_sizes.data(), k);
 
-    std::vector<std::vector<std::vector<int>>> deltas_matrix(k + 1);
-    for (int i = 1; i <= k; i++) {
-        deltas_matrix[i].resize(k + 1);
+    // Only the edges of the quotient graph named in the instruction stream
+    // are stored, so memory is proportional to the encoded size.
+    std::vector<std::tuple<int, int, int>> deltas; // (v, u, delta) with v >= u
+    if (dense) {
+        // One bitmap of gcd(size of cycle v, size of cycle u) bits for every edge (v, u), v >= u.
+        // The bitmaps are read in chunks of up to 31 bits and only the set bits are visited.
+        for (int v = 1; v <= k; v++) {
+            for (int u = 1; u <= v; u++) {
+                int m = gcds.gcd(v - 1, u - 1);
+                for (int x = 0; x < m; x += 31) {
+                    int w = std::min(31, m - x);
+                    int bits = reader.read(w);
+                    assert(bits != -1);
+                    while (bits != 0) {
+                        int l = 31 - __builtin_clz(bits); // highest set bit, i.e. the smallest delta
+                        deltas.emplace_back(v, u, x + w - 1 - l);
+                        bits ^= 1 << l;
+                    }
+                }
+            }
+        }
     }
-    pos = std::make_tuple(s_pos, 0); // Reset position for reading deltas
-    int b_k = log_2_ceil(k);
-    int v = 1;
-    int u = -1;
-    int m, b_ij = 1;
-    while (1) {
-        int b = read_k_bits(encoded, 1, pos);
-        if (b == -1) break;
-        if (b == 0) {
-            int x = read_k_bits(encoded, b_k, pos);
-            if (x == -1 || x == 0) break;
-            if (x > v) {
-                v = x;
-                u = -1;
+    else {
+        int b_k = log_2_ceil(k);
+        int v = 1;
+        int u = -1;
+        int b_ij = 1;
+        while (1) {
+            int b = reader.read(1);
+            if (b == -1) break;
+            if (b == 0) {
+                int x = reader.read(b_k);
+                if (x == -1 || x == 0) break;
+                if (x > v) {
+                    v = x;
+                    u = -1;
+                } else {
+                    u = x;
+                    b_ij = gcds.bits(v - 1, u - 1);
+                }
             } else {
-                u = x;
-                m = std::gcd(cycle_sizes[v - 1], cycle_sizes[u - 1]);
-                b_ij = log_2_ceil(m);
+                assert(u != -1);
+                // Remember that always v >= u
+                int delta = reader.read(b_ij);
+                assert(delta != -1);
+                deltas.emplace_back(v, u, delta);
             }
-        } else {
-            assert(u != -1);
-            // Remember that always v >= u
-            int delta = read_k_bits(encoded, b_ij, pos);
-            assert(delta != -1);
-            deltas_matrix[v][u].push_back(delta);
         }
     }
 
     // The indexing is based on the cyclic decomposition:
     // first orbit in order, second orbit in order, ...
-    std::vector<std::vector<int>> neighbors(n + 1);
-    // Generate neighbors list based on deltas_matrix
-    // source_o_i, target_o_i are the indices of the orbits in the cyclic decomposition
     std::vector<int> index_starts; // cumulative sum of the sizes of the orbits
     index_starts.reserve(k + 1);
     index_starts.push_back(0);
     for (int i = 0; i < k; i++) {
         index_starts.push_back(index_starts.back() + cycle_sizes[i]);
     }
-    for (int source_o_i = 1; source_o_i <= k; source_o_i++) {
-        for (int target_o_i = 1; target_o_i <= k; target_o_i++) {
-            // deltas_matrix only has the upper triangle, but we want our neighbors list to be 'symmetric'
-            int factor; // If the delta from source to target is x, then the delta from target to source is -x!
-            if (source_o_i >= target_o_i) factor = 1;
-            else factor = -1;
-            for (int x : deltas_matrix[std::max(target_o_i, source_o_i)][std::min(target_o_i, source_o_i)]) {
-                for (int i = 1; i <= cycle_sizes[source_o_i - 1]; i++) { // i = vertex index in the source orbit
-                    int s = 0;
-                    do {
-                        // The automorphism g^(cycle_sizes[source_o_i - 1]) fixes the source orbit,
-                        // but if the size of the target orbit is different it acts non-trivially in it.
-                        // Therefore each delta actually represents multiple edges specified by
-                        // the subgroup cycle_sizes[source_o_i - 1] generates in Z_{cycle_sizes[target_o_i - 1]}.
-                        neighbors[index_starts[source_o_i - 1] + i].push_back(
-                            index_starts[target_o_i - 1] +
-                            mod_index_1(i + factor*x + s, cycle_sizes[target_o_i - 1])
-                        );
-                        s = (s + cycle_sizes[source_o_i - 1]) % cycle_sizes[target_o_i - 1];
-                    } while (s != 0);
+    return SymmetricDescription{n, std::move(cycle_sizes), std::move(index_starts), std::move(deltas)};
+}
+
+/**
+ * Expands the deltas of the quotient graph into the edges of the graph.
+ * @param add_edge Callable void(int a, int b) called for every neighbor b of
+ *                 every vertex a (both 1-based), so twice for each edge
+ *                 between different vertices.
+ */
+template <typename AddEdge>
+static void expand_symmetric(const SymmetricDescription& desc, AddEdge add_edge) {
+    const std::vector<int>& cycle_sizes = desc.cycle_sizes;
+    const std::vector<int>& index_starts = desc.index_starts;
+    // source_o_i, target_o_i are the indices of the orbits in the cyclic decomposition
+    auto add_edges = [&](int source_o_i, int target_o_i, int x) {
+        int source_size = cycle_sizes[source_o_i - 1];
+        int target_size = cycle_sizes[target_o_i - 1];
+        int source_start = index_starts[source_o_i - 1];
+        int target_start = index_starts[target_o_i - 1];
+        // The automorphism g^(source_size) fixes the source orbit, but if the size of the
+        // target orbit is different it acts non-trivially in it. Therefore each delta
+        // actually represents multiple edges: the p-th vertex of the source orbit (0-based)
+        // is adjacent to the vertices y of the target orbit with y = p + x (mod m),
+        // m = gcd(source_size, target_size), which is the subgroup source_size generates
+        // in Z_{target_size}, shifted by p + x.
+        // Walking y = r, r + m, ... with r kept in [0, m) needs no division per edge.
+        if (source_size == target_size) {
+            // m is the size itself (always so for a semiregular automorphism), so every
+            // vertex has a single neighbor y = p + r, taken in two constant-stride runs.
+            int c = source_size;
+            int r = ((x % c) + c) % c;
+            for (int p = 0; p < c - r; p++) {
+                add_edge(source_start + p + 1, target_start + p + r + 1); // Convert to 1-based indexing
+            }
+            for (int p = c - r; p < c; p++) {
+                add_edge(source_start + p + 1, target_start + p + r - c + 1);
+            }
+            return;
+        }
+        int m = std::gcd(source_size, target_size);
+        int r = ((x % m) + m) % m;
+        for (int p = 0; p < source_size; p++) {
+            for (int y = r; y < target_size; y += m) {
+                add_edge(source_start + p + 1, target_start + y + 1); // Convert to 1-based indexing
+            }
+            r = r + 1 == m ? 0 : r + 1;
+        }
+    };
+    for (const auto& [source_o_i, target_o_i, x] : desc.deltas) {
+        add_edges(source_o_i, target_o_i, x);
+        // Only one direction of each edge is stored, but we want our neighbors list to be 'symmetric'.
+        // If the delta from source to target is x, then the delta from target to source is -x!
+        if (source_o_i != target_o_i) {
+            add_edges(target_o_i, source_o_i, -x);
+        }
+    }
+}
+
+/**
+ * @return The degree of the vertices of each orbit (all vertices of an orbit
+ *         have the same degree), 1-based like the orbits.
+ */
+static std::vector<int> orbit_degrees(const SymmetricDescription& desc) {
+    const std::vector<int>& cycle_sizes = desc.cycle_sizes;
+    std::vector<int> degrees(cycle_sizes.size() + 1);
+    CycleGcds gcds(cycle_sizes.data(), cycle_sizes.size());
+    for (const auto& [v, u, x] : desc.deltas) {
+        // Each delta is one coset of the subgroup generated by c_v in Z_{c_u}.
+        int m = gcds.gcd(v - 1, u - 1);
+        degrees[v] += cycle_sizes[u - 1] / m;
+        if (v != u) {
+            degrees[u] += cycle_sizes[v - 1] / m;
+        }
+    }
+    return degrees;
+}
+
+Graph decode_symmetric(std::string_view encoded) {
+    SymmetricDescription desc = parse_symmetric(encoded);
+    // The degrees follow from the deltas, so the arrays are allocated exactly once.
+    std::vector<int> degrees = orbit_degrees(desc);
+    int k = desc.cycle_sizes.size();
+    std::vector<int> offsets(desc.n + 2); // padded to use 1-based indexing
+    for (int i = 1; i <= k; i++) {
+        for (int a = desc.index_starts[i - 1] + 1; a <= desc.index_starts[i]; a++) {
+            offsets[a + 1] = offsets[a] + degrees[i];
+        }
+    }
+    std::vector<int> adjacency(offsets[desc.n + 1]);
+    std::vector<int> next(offsets.begin(), offsets.end() - 1); // next free position of every vertex
+    expand_symmetric(desc, [&](int a, int b) {
+        adjacency[next[a]++] = b;
+    });
+    return Graph(std::move(offsets), std::move(adjacency));
+}
+
+bool is_symmetric_encoding(std::string_view encoded) {
+    return encoded.size() >= 2 && encoded[0] == ':' && (encoded[1] == ':' || encoded[1] == ';');
+}
+
+void decode_to_sparsegraph(std::string_view encoded, sparsegraph* sg) {
+    SymmetricDescription desc = parse_symmetric(encoded);
+    std::vector<int> degrees = orbit_degrees(desc);
+    int k = desc.cycle_sizes.size();
+    size_t nde = 0;
+    for (int i = 1; i <= k; i++) {
+        nde += (size_t) degrees[i] * desc.cycle_sizes[i - 1];
+    }
+    SG_ALLOC(*sg, desc.n, nde, "decode_to_sparsegraph");
+    sg->nv = desc.n;
+    sg->nde = nde;
+    size_t epos = 0;
+    for (int i = 1; i <= k; i++) {
+        for (int a = desc.index_starts[i - 1]; a < desc.index_starts[i]; a++) {
+            sg->v[a] = epos;
+            sg->d[a] = 0; // counts up to degrees[i] while the edges are added
+            epos += degrees[i];
+        }
+    }
+    expand_symmetric(desc, [&](int a, int b) {
+        sg->e[sg->v[a - 1] + sg->d[a - 1]++] = b - 1; // Convert to 0-based indexing
+    });
+    // The deltas give the neighbors orbit by orbit and coset by coset; sorted,
+    // they are in the same order as from decode_small, so both write the same sparse6.
+    for (int a = 0; a < desc.n; a++) {
+        std::sort(sg->e + sg->v[a], sg->e + sg->v[a] + sg->d[a]);
+    }
+}
+
+/**
+ * Reads the 64 bits starting at bit pos of a bit string stored most
+ * significant bit first. The word after the one containing pos must exist.
+ */
+static inline uint64_t load_bits(const uint64_t* words, size_t pos) {
+    size_t w = pos / 64;
+    int b = pos % 64;
+    if (b == 0) return words[w];
+    return (words[w] << b) | (words[w + 1] >> (64 - b));
+}
+
+/**
+ * ORs len bits of src, starting at bit src_pos, into dst starting at bit dst_pos.
+ * Both are bit strings stored most significant bit first.
+ */
+static void or_bits(uint64_t* dst, size_t dst_pos, const uint64_t* src, size_t src_pos, size_t len) {
+    while (len > 0) {
+        int b = dst_pos % 64;
+        size_t take = std::min<size_t>(64 - b, len);
+        uint64_t bits = load_bits(src, src_pos);
+        if (take < 64) bits &= ~(~(uint64_t) 0 >> take); // keep the first take bits
+        dst[dst_pos / 64] |= bits >> b;
+        dst_pos += take;
+        src_pos += take;
+        len -= take;
+    }
+}
+
+std::string decode_to_graph6(std::string_view encoded) {
+    SymmetricDescription desc = parse_symmetric(encoded);
+    const std::vector<int>& cycle_sizes = desc.cycle_sizes;
+    const std::vector<int>& index_starts = desc.index_starts;
+    int n = desc.n;
+    int k = cycle_sizes.size();
+    // The block of the adjacency matrix between orbits v and u is circulant:
+    // the row of the i-th vertex of v is the row of the first vertex of v,
+    // rotated by i - 1 within the c_u columns of u. So only the row of the first
+    // vertex is built, as a pattern of c_u bits, for every pair of adjacent orbits.
+    std::vector<std::tuple<int, int, int>> directed; // (row orbit, column orbit, delta)
+    directed.reserve(2 * desc.deltas.size());
+    for (const auto& [v, u, x] : desc.deltas) {
+        directed.emplace_back(v, u, x);
+        if (v != u) {
+            directed.emplace_back(u, v, -x); // the delta from u to v
+        }
+    }
+    std::sort(directed.begin(), directed.end());
+    std::vector<int> block_starts(k + 2); // blocks of orbit v are block_starts[v] ... block_starts[v + 1] - 1
+    std::vector<std::tuple<int, size_t>> blocks; // (column orbit, offset of the pattern in patterns)
+    std::vector<uint64_t> patterns;
+    CycleGcds gcds(cycle_sizes.data(), k);
+    for (size_t l = 0; l < directed.size(); l++) {
+        const auto& [v, u, x] = directed[l];
+        int c_u = cycle_sizes[u - 1];
+        if (l == 0 || std::get<0>(directed[l - 1]) != v || std::get<1>(directed[l - 1]) != u) {
+            blocks.emplace_back(u, patterns.size());
+            block_starts[v + 1] = blocks.size();
+            patterns.resize(patterns.size() + c_u / 64 + 2); // one word of padding for load_bits
+        }
+        uint64_t* pattern = patterns.data() + std::get<1>(blocks.back());
+        // The same edges as in expand_symmetric for the first vertex, as 0-based columns of u.
+        int m = gcds.gcd(v - 1, u - 1);
+        for (int t = ((x % m) + m) % m; t < c_u; t += m) {
+            pattern[t / 64] |= (uint64_t) 1 << (63 - t % 64);
+        }
+    }
+    for (int v = 1; v <= k; v++) {
+        block_starts[v + 1] = std::max(block_starts[v + 1], block_starts[v]); // orbits without blocks
+    }
+
+    std::string out = string_N(n);
+    out.reserve(graph6_size(n));
+    BitWriter writer(out);
+    // graph6 stores the upper triangle column by column, and column j of the
+    // upper triangle is the first j bits of row j, so one row is built at a time.
+    std::vector<uint64_t> row(n / 64 + 1);
+    for (int v = 1; v <= k; v++) {
+        int c_v = cycle_sizes[v - 1];
+        for (int p = 0; p < c_v; p++) {
+            int j = index_starts[v - 1] + p; // 0-based row
+            std::fill(row.begin(), row.begin() + (j + 63) / 64, 0);
+            for (int b = block_starts[v]; b < block_starts[v + 1]; b++) {
+                const auto& [u, offset] = blocks[b];
+                int start = index_starts[u - 1];
+                if (start >= j) break; // later orbits start even further right
+                int c_u = cycle_sizes[u - 1];
+                int r = p % c_u;
+                const uint64_t* pattern = patterns.data() + offset;
+                // Rotated by r: pattern bits [0, c_u - r) go to columns [r, c_u)
+                // and pattern bits [c_u - r, c_u) to columns [0, r), all clipped to j.
+                if (start + r < j) {
+                    or_bits(row.data(), start + r, pattern, 0, std::min(c_u - r, j - start - r));
                 }
+                or_bits(row.data(), start, pattern, c_u - r, std::min(r, j - start));
+            }
+            int w = 0;
+            for (; 64 * (w + 1) <= j; w++) {
+                writer.write(row[w] >> 32, 32);
+                writer.write(row[w] & 0xffffffff, 32);
+            }
+            int rest = j - 64 * w; // bits in the last, partial word
+            if (rest > 32) {
+                writer.write(row[w] >> 32, 32);
+                writer.write((row[w] >> (64 - rest)) & ((1u << (rest - 32)) - 1), rest - 32);
+            } else if (rest > 0) {
+                writer.write(row[w] >> (64 - rest), rest);
             }
         }
     }
+    writer.align();
+    return out;
+}
 
-    return neighbors;
+Graph decode(std::string_view encoded) {
+    if (is_symmetric_encoding(encoded)) {
+        return decode_symmetric(encoded);
+    }
+    // Graphs for which the automorphism did not help are stored as plain graph6 / sparse6.
+    return nauty_decode(encoded);
+}
+
+std::string Graph::encode_shortest(const Permutation& automorphism, AdjacencyEncoding encoding) const {
+    std::string out = encode(automorphism, encoding);
+    size_t g6_size = graph6_size(n());
+    // Every edge takes at least 1 + log_2_ceil(n-1) bits in sparse6, so the
+    // sparse6 string only needs to be built if it can be the shortest.
+    int nb = n() > 1 ? log_2_ceil(n() - 1) : 0;
+    size_t s6_lower_bound = 1 + string_N(n()).size() + ((size_t) m() * (1 + nb) + 5) / 6;
+    if (s6_lower_bound < std::min(out.size(), g6_size + 1)) {
+        std::string s6 = to_sparse6();
+        if (s6.size() < out.size() && s6.size() <= g6_size) {
+            return s6;
+        }
+    }
+    if (g6_size < out.size()) {
+        return to_graph6();
+    }
+    return out;
 }
 
 void Graph::apply_morphism(const Permutation& morphism) {
     Permutation inv_morphism = morphism.inverse();
-    std::set<int> visited;
-    // Permute the outer vector of the neighbors list according to the morphism.
+    // Node i of the new graph is node inv_morphism(i) of the old one,
+    // with its neighbors mapped by the morphism.
+    std::vector<int> offsets(n() + 2);
     for (int i = 1; i <= n(); i++) {
-        // (1 2)(2 3)(3 4) = (1 4 3 2) = (1 2 3 4)^(-1)
-        while (visited.count(i) == 0 && inv_morphism.apply(i) != i) {
-            std::swap(m_neighbors[i], m_neighbors[inv_morphism.apply(i)]);
-            visited.insert(i);
-            i = inv_morphism.apply(i); // move to the next vertex in the cycle
-            if (visited.count(inv_morphism.apply(i)) > 0) {
-                visited.insert(i);
-                i = inv_morphism.apply(i); // move back to the start of the cycle
-                break;
-            }
-        }
+        offsets[i + 1] = offsets[i] + neighbors(inv_morphism.apply(i)).size();
     }
-    // Apply the morphism to the neighbors of each node.
+    std::vector<int> adjacency;
+    adjacency.reserve(m_adjacency.size());
     for (int i = 1; i <= n(); i++) {
-        morphism.apply(&(m_neighbors[i]));
+        for (int v : neighbors(inv_morphism.apply(i))) {
+            adjacency.push_back(morphism.apply(v));
+        }
     }
+    m_offsets = std::move(offsets);
+    m_adjacency = std::move(adjacency);
 }
 
 sparsegraph Graph::to_sparsegraph() const {
     sparsegraph sg;
     sg.nv = n();
-    sg.nde = 2 * m();
+    sg.nde = m_adjacency.size();
     sg.v = (size_t*) malloc(sg.nv * sizeof(size_t));
     sg.d = (int*) malloc(sg.nv * sizeof(int));
     sg.e = (int*) malloc(sg.nde * sizeof(int));
@@ -442,24 +997,534 @@ sparsegraph Graph::to_sparsegraph() const {
     sg.dlen = sg.nv;
     sg.elen = sg.nde;
     sg.wlen = 0;
-    size_t epos = 0;
+    // The layout is the same as ours, only 0-based.
     for (int i = 1; i <= n(); i++) {
-        sg.v[i - 1] = epos;
-        sg.d[i - 1] = m_neighbors[i].size();
-        for (int j : m_neighbors[i]) {
-            sg.e[epos++] = j - 1; // Convert to 0-based indexing
-        }
+        sg.v[i - 1] = m_offsets[i];
+        sg.d[i - 1] = m_offsets[i + 1] - m_offsets[i];
+    }
+    for (size_t epos = 0; epos < sg.nde; epos++) {
+        sg.e[epos] = m_adjacency[epos] - 1;
     }
-    assert(epos == sg.nde);
     return sg;
 }
 
 void Graph::to_densegraph(graph* g, int m_wordsize) const {
     EMPTYGRAPH(g,m_wordsize,n());
     for (int u = 1; u <= n(); u++) {
-        for (int v : neighbors()[u]) {
+        for (int v : neighbors(u)) {
             if (u <= v)
                 ADDONEEDGE(g, u-1, v-1, m_wordsize); // Convert to 0-based indexing
         }
     }
 }
+
+size_t graph6_size(int n) {
+    return string_N(n).size() + ((size_t) n * (n - 1) / 2 + 5) / 6;
+}
+
+std::string Graph::to_graph6() const {
+    std::string out = string_N(n());
+    out.reserve(graph6_size(n()));
+    BitWriter writer(out);
+    // The upper triangle of the adjacency matrix, column by column:
+    // x(0,1), x(0,2), x(1,2), x(0,3), x(1,3), x(2,3), ...
+    std::vector<int> column;
+    for (int j = 0; j < n(); j++) {
+        column.clear();
+        for (int i : neighbors(j + 1)) {
+            if (i - 1 < j) column.push_back(i - 1); // Convert to 0-based indexing
+        }
+        std::sort(column.begin(), column.end());
+        int x = 0; // next bit of the column
+        for (int i : column) {
+            for (; i - x > 0; x += std::min(i - x, 32)) {
+                writer.write(0, std::min(i - x, 32));
+            }
+            writer.write_bit(1);
+            x = i + 1;
+        }
+        for (; j - x > 0; x += std::min(j - x, 32)) {
+            writer.write(0, std::min(j - x, 32));
+        }
+    }
+    writer.align();
+    return out;
+}
+
+/**
+ * Encodes a graph in nauty's sparse6 format, see Graph::to_sparse6.
+ * @param n The number of vertices.
+ * @param visit_neighbors Callable void(int v, F f) that calls f(u) for every
+ *                        neighbor u of the vertex v (both 0-based).
+ * @param out The string to append the sparse6 string to.
+ */
+template <typename VisitNeighbors>
+static void write_sparse6(int n, VisitNeighbors visit_neighbors, std::string* out) {
+    *out += ':';
+    *out += string_N(n);
+    BitWriter writer(*out);
+    int nb = n > 1 ? log_2_ceil(n - 1) : 0; // number of bits needed for n-1
+    // Edges (i, j), i <= j, are grouped by j. Each is a sequence of bits b x,
+    // where x is nb bits long. b = 1 increments the current vertex v,
+    // then if x > v, v becomes x, otherwise the edge (x, v) is added.
+    int lastj = 0;
+    for (int j = 0; j < n; j++) {
+        visit_neighbors(j, [&](int i) {
+            if (i > j) return;
+            if (j == lastj) {
+                writer.write_bit(0);
+            } else {
+                writer.write_bit(1);
+                if (j > lastj + 1) {
+                    writer.write(j, nb);
+                    writer.write_bit(0);
+                }
+                lastj = j;
+            }
+            writer.write(i, nb);
+        });
+    }
+    // Pad with 1 bits, except that the padding must not be readable as an
+    // edge to the vertex n-1; in that case it starts with a 0 bit.
+    int padding = (6 - writer.partial_bits()) % 6;
+    if (padding > 0) {
+        if (padding >= nb + 1 && lastj == n - 2 && n == (1 << nb)) {
+            writer.write_bit(0);
+            padding--;
+        }
+        writer.write((1 << padding) - 1, padding);
+    }
+    writer.align();
+}
+
+std::string Graph::to_sparse6() const {
+    std::string out;
+    write_sparse6(n(), [this](int v, auto&& f) {
+        for (int u : neighbors(v + 1)) f(u - 1); // Convert to 0-based indexing
+    }, &out);
+    return out;
+}
+
+std::string to_sparse6(const sparsegraph& sg) {
+    std::string out;
+    write_sparse6(sg.nv, [&](int v, auto&& f) {
+        for (int i = 0; i < sg.d[v]; i++) f(sg.e[sg.v[v] + i]);
+    }, &out);
+    return out;
+}
+
+// Graphs with at most 64 vertices keep the adjacency as one word per vertex:
+// bit u of rows[v] is set if the vertices u and v (0-based) are adjacent.
+// Everything else is kept in fixed-size arrays as well, so encoding and
+// decoding them allocate no memory besides growing the output string.
+static const int small_max_n = 64;
+
+/**
+ * @return A mask of the lowest c bits, 1 <= c <= 64.
+ */
+static inline uint64_t low_bits(int c) {
+    return c == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << c) - 1;
+}
+
+/**
+ * Rotates the lowest c bits of x left by r, 0 <= r < c <= 64.
+ */
+static inline uint64_t rotate_bits(uint64_t x, int r, int c) {
+    if (r == 0) return x;
+    return ((x << r) | (x >> (c - r))) & low_bits(c);
+}
+
+/**
+ * Writes the lowest c bits of x, lowest bit first, 1 <= c <= 64.
+ */
+static inline void write_bits_reversed(BitWriter& writer, uint64_t x, int c) {
+    x = ((x >> 1) & 0x5555555555555555) | ((x & 0x5555555555555555) << 1);
+    x = ((x >> 2) & 0x3333333333333333) | ((x & 0x3333333333333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f0f0f0f0f) | ((x & 0x0f0f0f0f0f0f0f0f) << 4);
+    x = __builtin_bswap64(x) >> (64 - c); // bit 0 of x is now bit c - 1
+    if (c > 32) {
+        writer.write(x >> 32, c - 32);
+        writer.write(x & 0xffffffff, 32);
+    } else {
+        writer.write(x, c);
+    }
+}
+
+/**
+ * Appends the graph6 string of a graph with at most 64 vertices.
+ */
+static void write_small_graph6(int n, const uint64_t* rows, std::string* out) {
+    *out += string_N(n);
+    BitWriter writer(*out);
+    // Column j of the upper triangle is the first j bits of row j.
+    for (int j = 1; j < n; j++) {
+        write_bits_reversed(writer, rows[j], j);
+    }
+    writer.align();
+}
+
+/**
+ * Appends the sparse6 string of a graph with at most 64 vertices.
+ */
+static void write_small_sparse6(int n, const uint64_t* rows, std::string* out) {
+    write_sparse6(n, [rows](int v, auto&& f) {
+        uint64_t row = rows[v];
+        while (row) {
+            f(__builtin_ctzll(row));
+            row &= row - 1;
+        }
+    }, out);
+}
+
+bool encode_small(std::string_view str, std::string_view automorphism_str, AdjacencyEncoding encoding, bool fallback,
+                  std::string* out) {
+    if (strip_nauty_header(&str) || str.empty()) return false; // sparse6 takes the general path
+    int s_pos = 0;
+    if (str[0] == 126 && (str.size() < 4 || str[1] == 126)) return false;
+    int n = parse_N(str, &s_pos);
+    if (n < 1 || n > small_max_n) return false;
+
+    uint64_t rows[small_max_n] = {};
+    BitReader reader(str.substr(s_pos));
+    for (int j = 1; j < n; j++) {
+        // x(0,j), ..., x(j-1,j), read in chunks of up to 31 bits.
+        for (int i = 0; i < j; i += 31) {
+            int w = std::min(31, j - i);
+            int bits = reader.read(w);
+            if (bits == -1) return false; // truncated, nauty reports it on the general path
+            while (bits != 0) {
+                int l = 31 - __builtin_clz(bits);
+                int u = i + w - 1 - l;
+                rows[u] |= (uint64_t) 1 << j;
+                rows[j] |= (uint64_t) 1 << u;
+                bits ^= 1 << l;
+            }
+        }
+    }
+
+    // The automorphism, 0-based, checked like parse_automorphism does. If it is
+    // not a permutation of the vertices the general path reports the error.
+    int perm[small_max_n];
+    int count = 0;
+    uint64_t seen = 0;
+    bool valid = true;
+    size_t automorphism_end = scan_csv(automorphism_str, 0, '\n', [&](int x) {
+        if (count == n || x < 1 || x > n || (seen >> (x - 1) & 1)) {
+            valid = false;
+            return false;
+        }
+        seen |= (uint64_t) 1 << (x - 1);
+        perm[count++] = x - 1;
+        return true;
+    });
+    if (!valid || count != n || automorphism_end < automorphism_str.size()) return false;
+
+    // The cyclic decomposition as in Permutation::flat_cyclic_decomposition:
+    // every cycle from its minimum, sorted by length (descending) and then by
+    // their minimum, with a counting sort.
+    int found[small_max_n];
+    int found_starts[small_max_n + 1];
+    uint64_t visited = 0;
+    int k = 0;
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+        if (visited >> i & 1) continue;
+        found_starts[k++] = pos;
+        int current = i;
+        do {
+            visited |= (uint64_t) 1 << current;
+            found[pos++] = current;
+            current = perm[current];
+        } while (current != i);
+    }
+    found_starts[k] = pos;
+    int first_of_length[small_max_n + 2] = {};
+    for (int c = 0; c < k; c++) {
+        first_of_length[found_starts[c + 1] - found_starts[c]]++;
+    }
+    for (int l = n, sum = 0; l >= 1; l--) {
+        int count_l = first_of_length[l];
+        first_of_length[l] = sum;
+        sum += count_l;
+    }
+    int order[small_max_n];
+    for (int c = 0; c < k; c++) {
+        order[first_of_length[found_starts[c + 1] - found_starts[c]]++] = c;
+    }
+    int lengths[small_max_n];
+    int starts[small_max_n + 1];
+    int label[small_max_n]; // position of each vertex in the cyclic decomposition
+    starts[0] = 0;
+    for (int i = 0; i < k; i++) {
+        int c = order[i];
+        lengths[i] = found_starts[c + 1] - found_starts[c];
+        starts[i + 1] = starts[i] + lengths[i];
+        for (int t = 0; t < lengths[i]; t++) {
+            label[found[found_starts[c] + t]] = starts[i] + t;
+        }
+    }
+
+    // The deltas of the edge (i, j), j <= i, of the quotient graph as a bitmap:
+    // the row of the first vertex of cycle i, relabelled in cycle order, is cut
+    // to the columns of cycle j and folded onto gcd(c_i, c_j) bits. With a
+    // semiregular automorphism nothing needs to be folded, and for a circulant
+    // graph (a single cycle) the relabelled row is the connection set.
+    CycleGcds gcds(lengths, k);
+    uint64_t deltas[small_max_n * (small_max_n + 1) / 2];
+    int b_k = log_2_ceil(k);
+    size_t sparse_bits = 0, dense_bits = 0;
+    int pair = 0;
+    for (int i = 0; i < k; i++) {
+        int source = found[found_starts[order[i]]];
+        uint64_t relabelled = 0;
+        for (uint64_t row = rows[source]; row; row &= row - 1) {
+            relabelled |= (uint64_t) 1 << label[__builtin_ctzll(row)];
+        }
+        bool moved = i == 0; // the sparse stream starts at the first cycle
+        for (int j = 0; j <= i; j++, pair++) {
+            int m = gcds.gcd(i, j);
+            uint64_t columns = (relabelled >> starts[j]) & low_bits(lengths[j]);
+            if (!gcds.semiregular()) {
+                uint64_t folded = columns;
+                for (int t = m; t < lengths[j]; t += m) {
+                    folded |= columns >> t;
+                }
+                columns = folded & low_bits(m);
+            }
+            deltas[pair] = columns;
+            dense_bits += m;
+            if (deltas[pair] == 0) continue;
+            sparse_bits += (moved ? 0 : 1 + b_k) + 1 + b_k + __builtin_popcountll(deltas[pair]) * (1 + gcds.bits(i, j));
+            moved = true;
+        }
+    }
+    size_t sparse_chars = (sparse_bits + 5) / 6, dense_chars = (dense_bits + 5) / 6;
+    if (encoding == AdjacencyEncoding::automatic) {
+        encoding = dense_chars < sparse_chars ? AdjacencyEncoding::dense : AdjacencyEncoding::sparse;
+    }
+    bool sparse = encoding == AdjacencyEncoding::sparse;
+
+    // The cycle sizes as (number of cycles, size) groups, see plan_encoding.
+    int group_counts[small_max_n];
+    int group_sizes[small_max_n];
+    int groups = 0;
+    int multi_cycles = 0;
+    for (int i = 0; i < k; i++) {
+        if (groups > 0 && group_sizes[groups - 1] == lengths[i]) {
+            if (group_counts[groups - 1]++ == 1) multi_cycles++;
+        } else {
+            group_counts[groups] = 1;
+            group_sizes[groups++] = lengths[i];
+        }
+    }
+    int b_n = log_2_ceil(n);
+    int header_bits = b_n * (2 + multi_cycles + groups);
+    size_t size = 2 + string_N(n).size() + (header_bits + 5) / 6 + (sparse ? sparse_chars : dense_chars);
+
+    if (fallback) {
+        // The same choice as Graph::encode_shortest.
+        size_t g6_size = graph6_size(n);
+        int edges = 0;
+        for (int v = 0; v < n; v++) {
+            edges += __builtin_popcountll(rows[v]);
+        }
+        edges /= 2;
+        int nb = n > 1 ? log_2_ceil(n - 1) : 0;
+        size_t s6_lower_bound = 1 + string_N(n).size() + ((size_t) edges * (1 + nb) + 5) / 6;
+        if (s6_lower_bound < std::min(size, g6_size + 1)) {
+            size_t start = out->size();
+            write_small_sparse6(n, rows, out);
+            size_t s6_size = out->size() - start;
+            if (s6_size < size && s6_size <= g6_size) {
+                return true;
+            }
+            out->resize(start);
+        }
+        if (g6_size < size) {
+            write_small_graph6(n, rows, out);
+            return true;
+        }
+    }
+
+    *out += sparse ? "::" : ":;";
+    *out += string_N(n);
+    BitWriter writer(*out);
+    for (int g = 0; g < groups; g++) {
+        if (group_counts[g] > 1) {
+            writer.write(group_counts[g], b_n);
+            writer.write(group_sizes[g], b_n);
+        }
+    }
+    writer.write(0, b_n);
+    for (int g = 0; g < groups; g++) {
+        if (group_counts[g] == 1) {
+            writer.write(group_sizes[g], b_n);
+        }
+    }
+    writer.write(0, b_n);
+    writer.align();
+    pair = 0;
+    if (sparse) {
+        // The instructions of encode_sparse_adjacency.
+        for (int i = 0; i < k; i++) {
+            bool moved = i == 0;
+            for (int j = 0; j <= i; j++, pair++) {
+                if (deltas[pair] == 0) continue;
+                if (!moved) {
+                    writer.write_bit(0);
+                    writer.write(i + 1, b_k);
+                    moved = true;
+                }
+                writer.write_bit(0);
+                writer.write(j + 1, b_k);
+                int b_ij = gcds.bits(i, j);
+                for (uint64_t d = deltas[pair]; d; d &= d - 1) {
+                    writer.write_bit(1);
+                    writer.write(__builtin_ctzll(d), b_ij);
+                }
+            }
+        }
+    } else {
+        // The bitmaps of encode_dense_adjacency, delta 0 first.
+        for (int i = 0; i < k; i++) {
+            for (int j = 0; j <= i; j++, pair++) {
+                write_bits_reversed(writer, deltas[pair], gcds.gcd(i, j));
+            }
+        }
+    }
+    writer.align();
+    return true;
+}
+
+bool decode_small(std::string_view encoded, bool sparse6, std::string* out) {
+    if (!is_symmetric_encoding(encoded)) return false;
+    bool dense = encoded[1] == ';';
+    int s_pos = 2;
+    int n = parse_N(encoded, &s_pos);
+    if (n < 1 || n > small_max_n) return false;
+
+    // The cycle sizes, see parse_symmetric. Malformed or truncated strings are
+    // left to the general path, which reports them.
+    int lengths[small_max_n];
+    int k = 0;
+    BitReader reader(encoded.substr(s_pos));
+    int b_n = log_2_ceil(n);
+    while (true) {
+        int count = reader.read(b_n);
+        if (count == -1) return false;
+        if (count == 0) break;
+        int size = reader.read(b_n);
+        if (size <= 0 || k + count > n) return false;
+        for (int i = 0; i < count; i++) {
+            lengths[k++] = size;
+        }
+    }
+    while (true) {
+        int size = reader.read(b_n);
+        if (size == -1) return false;
+        if (size == 0) break;
+        if (k == n) return false;
+        lengths[k++] = size;
+    }
+    reader.align();
+    std::sort(lengths, lengths + k, std::greater<int>());
+    int starts[small_max_n + 1];
+    starts[0] = 0;
+    for (int i = 0; i < k; i++) {
+        starts[i + 1] = starts[i] + lengths[i];
+    }
+    if (starts[k] != n) return false;
+
+    // patterns[v * k + u] is the row of the first vertex of cycle v cut to the
+    // columns of cycle u, every delta x being the columns x, x + m, x + 2m, ...
+    // with m = gcd(c_v, c_u). With a semiregular automorphism every delta is a
+    // single column.
+    CycleGcds gcds(lengths, k);
+    uint64_t patterns[small_max_n * small_max_n];
+    std::fill(patterns, patterns + k * k, 0);
+    auto add_delta = [&](int v, int u, int x) {
+        int m = gcds.gcd(v, u);
+        if (gcds.semiregular()) {
+            patterns[v * k + u] |= (uint64_t) 1 << x;
+            if (v != u) patterns[u * k + v] |= (uint64_t) 1 << (x == 0 ? 0 : m - x);
+            return;
+        }
+        uint64_t coset = 0;
+        for (int t = 0; t < lengths[u]; t += m) {
+            coset |= (uint64_t) 1 << t;
+        }
+        patterns[v * k + u] |= coset << x;
+        if (v != u) {
+            // The delta from u to v is -x.
+            coset = 0;
+            for (int t = 0; t < lengths[v]; t += m) {
+                coset |= (uint64_t) 1 << t;
+            }
+            patterns[u * k + v] |= coset << (x == 0 ? 0 : m - x);
+        }
+    };
+    if (dense) {
+        for (int v = 0; v < k; v++) {
+            for (int u = 0; u <= v; u++) {
+                int m = gcds.gcd(v, u);
+                for (int x = 0; x < m; x += 31) {
+                    int w = std::min(31, m - x);
+                    int bits = reader.read(w);
+                    if (bits == -1) return false;
+                    while (bits != 0) {
+                        int l = 31 - __builtin_clz(bits);
+                        add_delta(v, u, x + w - 1 - l);
+                        bits ^= 1 << l;
+                    }
+                }
+            }
+        }
+    } else {
+        int b_k = log_2_ceil(k);
+        int v = 0;
+        int u = -1;
+        int b_ij = 1;
+        while (true) {
+            int b = reader.read(1);
+            if (b == -1) break;
+            if (b == 0) {
+                int x = reader.read(b_k);
+                if (x == -1 || x == 0) break;
+                if (x > k) return false;
+                if (x - 1 > v) {
+                    v = x - 1;
+                    u = -1;
+                } else {
+                    u = x - 1;
+                    b_ij = gcds.bits(v, u);
+                }
+            } else {
+                if (u == -1) return false;
+                int delta = reader.read(b_ij);
+                if (delta == -1 || delta >= gcds.gcd(v, u)) return false;
+                add_delta(v, u, delta);
+            }
+        }
+    }
+
+    // The p-th vertex of cycle v has the pattern of the first one rotated by p.
+    uint64_t rows[small_max_n];
+    for (int v = 0; v < k; v++) {
+        for (int p = 0; p < lengths[v]; p++) {
+            uint64_t row = 0;
+            for (int u = 0; u < k; u++) {
+                uint64_t pattern = patterns[v * k + u];
+                if (pattern != 0) {
+                    row |= rotate_bits(pattern, p % lengths[u], lengths[u]) << starts[u];
+                }
+            }
+            rows[starts[v] + p] = row;
+        }
+    }
+    if (sparse6) {
+        write_small_sparse6(n, rows, out);
+    } else {
+        write_small_graph6(n, rows, out);
+    }
+    return true;
+}
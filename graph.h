@@ -3,31 +3,67 @@
 #include "permutation.h"
 #include <vector>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include "include/nauty/gtools.h"
 
+/** How Graph::encode stores the edges between the orbits of the automorphism. */
+enum class AdjacencyEncoding {
+    sparse,     // instruction stream naming each delta, prefix "::"
+    dense,      // one bitmap per pair of orbits, prefix ":;"
+    automatic   // whichever of the two is shorter for the given graph
+};
+
+/**
+ * A read-only view of the neighbors of one vertex, pointing into the
+ * adjacency array of a Graph. Valid as long as the graph is not modified.
+ */
+class NeighborList {
+public:
+    NeighborList(const int* begin, const int* end) : m_begin(begin), m_end(end) {}
+    const int* begin() const { return m_begin; }
+    const int* end() const { return m_end; }
+    size_t size() const { return m_end - m_begin; }
+    int operator[](size_t i) const { return m_begin[i]; }
+
+private:
+    const int* m_begin;
+    const int* m_end;
+};
+
 class Graph {
 public:
     /**
-     *  Returns the neighbors list of the graph. The indexing is 1-based
-     *  and the list is padded so that neighbors()[1] are the neighbors of node 1.
+     * Returns the neighbors of a node. The indexing of the nodes is 1-based.
+     * @param v The node, 1 <= v <= n().
+     * @return A view of the neighbors of v.
      */
-    const std::vector<std::vector<int>>& neighbors() const {
-        return m_neighbors;
+    NeighborList neighbors(int v) const {
+        return NeighborList(m_adjacency.data() + m_offsets[v], m_adjacency.data() + m_offsets[v + 1]);
     }
     /** @return The number of nodes in the graph. */
     int n() const {
-        return m_neighbors.size() - 1; // index 0 is not a node
+        return m_offsets.size() - 2; // index 0 is not a node, the last entry closes node n
     }
     /** @return The number of edges in the graph. */
-    int m() const;
+    int m() const {
+        return m_edge_count;
+    }
 
     /** 
      * Constructor from a neighbors list. 
      * @param neighbors Neighbors list. Must be 1-based indexing and padded
-     *                  so that neighbors()[1] are the neighbors of node 1.
+     *                  so that neighbors[1] are the neighbors of node 1.
      */
-    Graph(std::vector<std::vector<int>> neighbors);
-
+    Graph(const std::vector<std::vector<int>>& neighbors);
+    /**
+     * Constructor from a compressed sparse row representation.
+     * @param offsets n + 2 offsets into adjacency, 1-based: the neighbors of node v
+     *                are adjacency[offsets[v]] ... adjacency[offsets[v + 1] - 1].
+     *                offsets[0] = offsets[1] = 0.
+     * @param adjacency The neighbors of all nodes, one node after the other.
+     */
+    Graph(std::vector<int> offsets, std::vector<int> adjacency);
 
     /**
      * Checks if two graphs are identical (completely identical, not just
@@ -56,11 +92,22 @@ public:
     /**
      * Encodes the graph as a string using the given automorphism.
      * @param automorphism The automorphism to use for encoding.
-     * @param sparse If true, uses sparse encoding, otherwise uses dense encoding.
-     * @return A string representation of the graph in the form
-     *         "n:k:d/s:...".
+     * @param encoding The adjacency encoding to use. With AdjacencyEncoding::automatic
+     *                 the exact length of both encodings is computed first and the
+     *                 shorter one is written.
+     * @return A string representation of the graph starting with "::" for the
+     *         sparse and ":;" for the dense encoding of the adjacency.
+     */
+    std::string encode(const Permutation& automorphism, AdjacencyEncoding encoding) const;
+    /**
+     * Encodes the graph with the given automorphism like encode(), unless the
+     * plain graph6 or sparse6 string of the graph is shorter, in which case
+     * that one is returned. decode() accepts all three.
+     * @param automorphism The automorphism to use for encoding.
+     * @param encoding The adjacency encoding to use for the symmetric encoding.
+     * @return The shortest of the three encodings.
      */
-    std::string encode(const Permutation& automorphism, bool sparse) const;
+    std::string encode_shortest(const Permutation& automorphism, AdjacencyEncoding encoding) const;
     /**
      * Applies the given morphism to the graph, modifying it in place.
      * @param morphism A vector of integers representing the morphism to apply.
@@ -83,38 +130,203 @@ public:
      *     graph1.to_densegraph(g, m); // graph1 is of type Graph
      */
     void to_densegraph(graph* g, int m_wordsize) const;
+    /**
+     * Encodes the graph in nauty's graph6 format, without header and newline.
+     * The result is the same as writeg6 on the output of to_densegraph.
+     * @return The graph6 string of the graph.
+     */
+    std::string to_graph6() const;
+    /**
+     * Encodes the graph in nauty's sparse6 format, without header and newline.
+     * The result is the same as writes6_sg on the output of to_sparsegraph.
+     * @return The sparse6 string of the graph.
+     */
+    std::string to_sparse6() const;
 
 private:
-    std::vector<std::vector<int>> m_neighbors;
-    std::string encode_dense_adjacency(const std::vector<std::vector<int>>& cyclic_decomposition) const;
-    std::string encode_sparse_adjacency(const std::vector<std::vector<int>>& cyclic_decomposition) const;
+    // Compressed sparse row storage, see Graph(offsets, adjacency).
+    std::vector<int> m_offsets;
+    std::vector<int> m_adjacency;
+    int m_edge_count; // cached, every edge appears twice in m_adjacency
+};
+
+/**
+ * Encodes a graph in nauty's dense format with the given automorphism, with
+ * the same result as Graph::encode. Only the rows of the first vertex of
+ * each cycle are read, so no Graph needs to be built.
+ * @param g The graph, m_wordsize * n setwords.
+ * @param m_wordsize The number of setwords per row.
+ * @param n The number of vertices.
+ */
+std::string encode(const graph* g, int m_wordsize, int n, const Permutation& automorphism, AdjacencyEncoding encoding);
+/**
+ * Encodes a sparsegraph with the given automorphism, like the dense overload.
+ */
+std::string encode(const sparsegraph& sg, const Permutation& automorphism, AdjacencyEncoding encoding);
+/**
+ * Computes the exact length of encode(g, m_wordsize, n, automorphism, encoding)
+ * from the cycle type and the deltas, without writing the encoding.
+ * @param cycles The cyclic decomposition of the automorphism, as returned by
+ *               Permutation::flat_cyclic_decomposition.
+ */
+size_t encoded_size(const graph* g, int m_wordsize, int n, const CyclicDecomposition& cycles, AdjacencyEncoding encoding);
+/**
+ * Computes the exact length of encode(sg, automorphism, encoding), like the dense overload.
+ */
+size_t encoded_size(const sparsegraph& sg, const CyclicDecomposition& cycles, AdjacencyEncoding encoding);
+/**
+ * A graph6 / sparse6 string parsed into nauty's representation, a sparsegraph
+ * or a dense graph depending on the format. It is parsed once and then used to
+ * find automorphisms, score them and encode the graph.
+ */
+class NautyGraph {
+public:
+    /**
+     * @param str The graph6 / sparse6 string, detected as in nauty_decode.
+     */
+    explicit NautyGraph(std::string_view str);
+    ~NautyGraph();
+    NautyGraph(const NautyGraph&) = delete;
+    NautyGraph& operator=(const NautyGraph&) = delete;
+
+    /** @return The number of vertices. */
+    int n() const { return m_n; }
+    /** @return Whether the graph was sparse6 and so is held as a sparsegraph. */
+    bool is_sparse() const { return m_sparse; }
+    /** @return The sparsegraph, only if is_sparse(). */
+    sparsegraph* sparse_graph() { return &m_sg; }
+    /** @return The dense graph, m_wordsize() * n() setwords, only if !is_sparse(). */
+    graph* dense_graph() { return m_g.data(); }
+    /** @return The number of setwords per row of the dense graph. */
+    int m_wordsize() const { return m_m; }
+    /**
+     * Encodes the graph with the given automorphism, see Graph::encode.
+     */
+    std::string encode(const Permutation& automorphism, AdjacencyEncoding encoding) const;
+    /**
+     * Computes the exact length of the encoding with the automorphism whose
+     * cycles are given, see encoded_size.
+     */
+    size_t encoded_size(const CyclicDecomposition& cycles, AdjacencyEncoding encoding) const;
+    /**
+     * @return The graph as a Graph object, as nauty_decode would return it.
+     */
+    Graph to_Graph() const;
 
+private:
+    bool m_sparse;
+    sparsegraph m_sg;
+    std::vector<graph> m_g; // not DYNALLSTAT, see nauty_decode_dense
+    int m_m = 0;
+    int m_n = 0;
 };
 
+/**
+ * Encodes a graph6 / sparse6 string with the given automorphism. The same as
+ * nauty_decode(str).encode(automorphism, encoding), but the graph is encoded
+ * straight from nauty's representation.
+ * @param str The graph6 / sparse6 string, detected as in nauty_decode.
+ * @return The encoded graph, see Graph::encode.
+ */
+std::string nauty_encode(std::string_view str, const Permutation& automorphism, AdjacencyEncoding encoding);
+
 /**
  * Decodes a string of the form "n:n_11,n_12,...;n_21,n_22,...;..." into a Graph object.
  * @param str The string to decode.
  * @return A Graph object representing the decoded graph.
  */
-Graph simple_decode(const std::string& str);
+Graph simple_decode(std::string_view str);
 /**
- * Decodes a automorphism based encoding string of the form "::.*" into a Graph object.
- * into a Graph object.
+ * Decodes a automorphism based encoding string of the form "::.*" (sparse)
+ * or ":;.*" (dense) into a Graph object.
+ * Any other string is decoded as graph6 / sparse6 with nauty_decode, since
+ * Graph::encode_shortest falls back to those.
  * @param str The string to decode.
  * @return A Graph object representing the decoded graph.
  */
-Graph decode(const std::string& str);
+Graph decode(std::string_view str);
+/**
+ * @return Whether str is an automorphism based encoding ("::" or ":;")
+ *         rather than graph6 / sparse6.
+ */
+bool is_symmetric_encoding(std::string_view str);
+/**
+ * Decodes an automorphism based encoding straight into a sparsegraph, without
+ * building a Graph. The arrays are sized exactly from the degrees of the orbits,
+ * which follow from the deltas. They are only reallocated when too small, so
+ * one sparsegraph can be reused for many graphs.
+ * The result is the same graph as decode(), with the neighbors of every vertex
+ * in ascending order.
+ * @param str The string to decode, is_symmetric_encoding(str) must hold.
+ * @param sg The sparsegraph to fill, initialized with SG_INIT and freed with SG_FREE.
+ */
+void decode_to_sparsegraph(std::string_view str, sparsegraph* sg);
+/**
+ * Decodes an automorphism based encoding straight into a graph6 string, without
+ * building a Graph. Every block of the adjacency matrix between two orbits is
+ * circulant, so the rows are produced by rotating the row of the first vertex
+ * of each orbit a word at a time.
+ * The result is the same as decode(str).to_graph6().
+ * @param str The string to decode, is_symmetric_encoding(str) must hold.
+ * @return The graph6 string, without header and newline.
+ */
+std::string decode_to_graph6(std::string_view str);
+/**
+ * Encodes a graph6 string of a graph with at most 64 vertices with the given
+ * automorphism, with the same result as nauty_encode (or, with fallback, as
+ * nauty_decode(str).encode_shortest). The adjacency is kept as one word per
+ * vertex and the deltas are found by folding the rows of the first vertex of
+ * each cycle, so no memory is allocated besides growing out.
+ * @param str The graph6 string, with or without the >>graph6<< header.
+ * @param automorphism_str The automorphism, in the format of parse_automorphism.
+ * @param fallback Whether plain graph6 / sparse6 is written when it is shorter.
+ * @param out The string to append the encoded graph to.
+ * @return False, with out unchanged, if str is sparse6, the graph has more
+ *         than 64 vertices or automorphism_str is not a permutation of its
+ *         vertices; those need the general path.
+ */
+bool encode_small(std::string_view str, std::string_view automorphism_str, AdjacencyEncoding encoding, bool fallback,
+                  std::string* out);
+/**
+ * Decodes an automorphism based encoding of a graph with at most 64 vertices
+ * straight into a graph6 or sparse6 string. Every row is one word, built by
+ * rotating the circulant blocks of the first vertex of its orbit.
+ * The graph6 string is the same as decode_to_graph6(str); the sparse6 string
+ * lists the neighbors of every vertex in ascending order, so it is the same
+ * as to_sparse6 of decode_to_sparsegraph(str).
+ * @param str The string to decode.
+ * @param sparse6 Whether sparse6 rather than graph6 is written.
+ * @param out The string to append the graph6 / sparse6 string to.
+ * @return False, with out unchanged, if str is not an automorphism based
+ *         encoding or the graph has more than 64 vertices.
+ */
+bool decode_small(std::string_view str, bool sparse6, std::string* out);
+/**
+ * Encodes a sparsegraph in nauty's sparse6 format, like Graph::to_sparse6.
+ * @return The sparse6 string of the graph, without header and newline.
+ */
+std::string to_sparse6(const sparsegraph& sg);
+/**
+ * Removes a ">>graph6<<" / ">>sparse6<<" header and detects the format.
+ * @param str A graph6 or sparse6 string, the header is removed in place.
+ * @return True for sparse6, false for graph6.
+ */
+bool strip_nauty_header(std::string_view* str);
 /**
  * Decodes a graph from a string in the format used by nauty's graph6 or sparse6 encoding,
  * detected automatically.
  * @param str The string to decode.
  * @return A Graph object representing the decoded graph.
  */
-Graph nauty_decode(const std::string& str);
+Graph nauty_decode(std::string_view str);
+/**
+ * @return The length of the graph6 string of any graph with n vertices.
+ */
+size_t graph6_size(int n);
 /**
  * Convert a graph in either of nauty's formats to a Graph object.
  */
-Graph graph_to_Graph(const graph& g, int m_wordsize, int n);
+Graph graph_to_Graph(const graph* g, int m_wordsize, int n);
 Graph sparsegraph_to_Graph(const sparsegraph& sg);
 /**
  * Computes the cyclic decomposition of a permutation.
@@ -1,11 +1,56 @@
 #pragma once
 #include <vector>
 #include <string>
-#include <tuple>
+#include <string_view>
+#include <charconv>
+
+/**
+ * Scans a substring of integers separated by commas and ending with a terminator,
+ * the parser shared by process_csv and the automorphism parsers.
+ * Spaces and tabs around the numbers are skipped, like sscanf("%d") does, and a
+ * carriage return ends the substring like the terminator.
+ * @param input The input string containing the substring with integers.
+ * @param position The starting position in the input substring.
+ * @param terminator The character that marks the end of the substring.
+ * @param push Callable bool(int) called for every integer in order, returning
+ *             false to stop the scan.
+ * @return The position after the terminator, or where the scan stopped if the
+ *         substring holds something else than integers and commas.
+ */
+template <typename Push>
+size_t scan_csv(std::string_view input, size_t position, char terminator, Push push) {
+    const char* p = input.data() + position;
+    const char* end = input.data() + input.size();
+    auto skip_blanks = [&] {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+    };
+    skip_blanks();
+    while (p < end && *p != terminator && *p != '\r') {
+        int value;
+        auto [next, error] = std::from_chars(p, end, value);
+        if (error != std::errc() || !push(value)) {
+            return p - input.data(); // Not a number, so the substring ends here
+        }
+        p = next;
+        skip_blanks();
+        if (p < end && *p == ',') {
+            p++;
+            skip_blanks();
+        }
+    }
+    if (p < end && *p == '\r') {
+        p++;
+    }
+    if (p < end && *p == terminator) {
+        p++; // Move past the terminator
+    }
+    return p - input.data();
+}
 
 /**
  * Process a substring of integers separated by commas and ending with a terminator.
  * If the string is missing a terminator at the end, it will be processed until the end of the string.
+ * The substring is read once, in time linear in its length, see scan_csv.
  * Example input: "11,17,3,43;"
  * @param input The input string containing the substring with integers.
  * @param position The starting position in the input substring.
@@ -14,7 +59,7 @@
  * @return The position in the input string the terminator at the end of the 
  *         processed substring.
  */
-int process_csv(const std::string& input, size_t position, char terminator, std::vector<int>* output);
+int process_csv(std::string_view input, size_t position, char terminator, std::vector<int>* output);
 
 /**
  * Computes the modulus of x, guaranteeing that the result is in the range [1, m].
@@ -24,13 +69,3 @@ int process_csv(const std::string& input, size_t position, char terminator, std:
  */
 int mod_index_1(int x, int m);
 
-/**
- * Reads k bits from the string s starting at the position specified by pos,
- * where each character c represents the 6 bits if (c-63) and pos={a, b},
- * where 0 <= a < length(s) and 0 <= b < 6.
- * Function also modifies pos to point to the next character after the k bits.
- * @param s The string to read bits from.
- * @param pos A tuple containing the current position in the string and the bit position within the character.
- * @return The bits read from the string as an integer, or -1 if there are not enough bits left.
-*/
-int read_k_bits(const std::string& s, int k, std::tuple<int, int>& pos);
\ No newline at end of file
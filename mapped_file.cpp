@@ -0,0 +1,145 @@
+#include "mapped_file.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+// Size of the chunks a file that is not mapped is read in.
+const size_t stream_chunk_size = 1 << 20;
+
+MappedFile::MappedFile(const std::string& fname) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    if (size == 0) { // mmap does not accept a length of 0
+        close(fd);
+        m_open = true;
+        return;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid after the descriptor is closed
+    if (addr == MAP_FAILED) return;
+    // Both are only hints, so failures are ignored.
+    madvise(addr, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(addr, size, MADV_HUGEPAGE);
+#endif
+    m_data = std::string_view(static_cast<const char*>(addr), size);
+    m_open = true;
+}
+
+MappedFile::~MappedFile() {
+    if (!m_data.empty()) {
+        munmap(const_cast<char*>(m_data.data()), m_data.size());
+    }
+}
+
+LineReader::LineReader(const std::string& fname) {
+    m_mapped.emplace(fname);
+    if (m_mapped->is_open()) {
+        m_data = m_mapped->data();
+        m_open = true;
+        return;
+    }
+    // Pipes, /dev/stdin, process substitution and files mmap refuses are streamed.
+    m_mapped.reset();
+    m_fd = open(fname.c_str(), O_RDONLY);
+    m_open = m_fd >= 0;
+}
+
+LineReader::~LineReader() {
+    if (m_fd >= 0) close(m_fd);
+}
+
+bool LineReader::fill() {
+    if (m_mapped || m_eof || m_data.find('\n', m_position) != std::string_view::npos) {
+        return m_position < m_data.size();
+    }
+    // The incomplete line starts a new chunk: the old one is never changed,
+    // as batches may still hold slices of it.
+    std::string_view rest = m_data.substr(m_position);
+    auto chunk = std::make_shared<std::string>();
+    chunk->reserve(std::max(stream_chunk_size, 2 * rest.size()));
+    chunk->append(rest);
+    // Read until the chunk is full, growing it while it does not hold a whole line.
+    while (true) {
+        size_t size = chunk->size();
+        if (size == chunk->capacity()) {
+            if (chunk->find('\n', rest.size()) != std::string::npos) break;
+            chunk->reserve(2 * size);
+        }
+        chunk->resize(chunk->capacity());
+        ssize_t count = read(m_fd, &(*chunk)[size], chunk->size() - size);
+        if (count < 0 && errno == EINTR) {
+            chunk->resize(size);
+            continue;
+        }
+        if (count < 0) {
+            std::cerr << "Error reading input: " << strerror(errno) << std::endl;
+        }
+        if (count <= 0) {
+            chunk->resize(size);
+            m_eof = true;
+            break;
+        }
+        chunk->resize(size + count);
+    }
+    m_chunk_offset += m_position;
+    m_chunk = std::move(chunk);
+    m_data = *m_chunk;
+    m_position = 0;
+    return m_position < m_data.size();
+}
+
+void LineReader::keep_chunk(std::vector<Chunk>* chunks) const {
+    if (m_chunk && std::find(chunks->begin(), chunks->end(), m_chunk) == chunks->end()) {
+        chunks->push_back(m_chunk);
+    }
+}
+
+bool LineReader::next_line(std::string_view* line, std::vector<Chunk>* chunks) {
+    if (!fill()) return false;
+    *line = ::next_line(m_data, &m_position);
+    keep_chunk(chunks);
+    return true;
+}
+
+bool LineReader::next_lines(size_t min_bytes, std::string_view* text, std::vector<Chunk>* chunks) {
+    if (!fill()) return false;
+    size_t end = m_data.find('\n', std::min(m_position + min_bytes, m_data.size()));
+    if (end != std::string_view::npos) {
+        end++;
+    } else if (m_mapped || m_eof) {
+        end = m_data.size();
+    } else {
+        end = m_data.rfind('\n') + 1; // the rest of the chunk is an incomplete line
+    }
+    *text = m_data.substr(m_position, end - m_position);
+    m_position = end;
+    keep_chunk(chunks);
+    return true;
+}
+
+std::string_view next_line(std::string_view data, size_t* position) {
+    size_t start = *position;
+    size_t end = data.find('\n', start);
+    if (end == std::string_view::npos) {
+        end = data.size();
+        *position = end;
+    } else {
+        *position = end + 1;
+    }
+    if (end > start && data[end - 1] == '\r') {
+        end--; // CRLF line ending
+    }
+    return data.substr(start, end - start);
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * A read-only memory mapping of a whole regular file.
+ * The contents are exposed as a std::string_view, so lines can be handed to
+ * the parsers as slices of the mapping instead of being copied into strings.
+ * The kernel is told that the file is read sequentially (and, where supported,
+ * that huge pages may be used), so it reads ahead aggressively.
+ */
+class MappedFile {
+public:
+    /**
+     * Maps the file into memory. Check is_open() afterwards; it is false for
+     * files that cannot be mapped, like pipes.
+     * @param fname The name of the file to map.
+     */
+    explicit MappedFile(const std::string& fname);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    /**
+     * @return Whether the file was opened and mapped successfully.
+     */
+    bool is_open() const { return m_open; }
+    /**
+     * @return The contents of the file. Valid as long as the MappedFile exists.
+     */
+    std::string_view data() const { return m_data; }
+
+private:
+    std::string_view m_data;
+    bool m_open = false;
+};
+
+/**
+ * Reads a file line by line.
+ * Regular files are mapped with MappedFile and the lines are slices of the
+ * mapping. Other files (pipes, /dev/stdin, process substitution) are read in
+ * chunks of about a megabyte as the data arrives; their lines are slices of a
+ * chunk, which is shared by the batches holding its lines and freed with the
+ * last of them. So memory stays bounded by the batches in flight, and the
+ * first lines are available before the writer of the pipe has finished.
+ */
+class LineReader {
+public:
+    using Chunk = std::shared_ptr<const std::string>;
+
+    /**
+     * Opens the file. Check is_open() afterwards.
+     * @param fname The name of the file to read.
+     */
+    explicit LineReader(const std::string& fname);
+    ~LineReader();
+    LineReader(const LineReader&) = delete;
+    LineReader& operator=(const LineReader&) = delete;
+    /**
+     * @return Whether the file was opened successfully.
+     */
+    bool is_open() const { return m_open; }
+    /**
+     * @return The size of a mapped file, or 0 for a streamed one, whose size is not known.
+     */
+    size_t size() const { return m_mapped ? m_data.size() : 0; }
+    /**
+     * @return The number of bytes read so far.
+     */
+    size_t position() const { return m_chunk_offset + m_position; }
+    /**
+     * Reads the next line.
+     * @param line Set to the line without the trailing newline (and carriage return, for CRLF files).
+     * @param chunks The chunk the line is a slice of is added unless it is already there,
+     *               so the line stays valid as long as chunks is kept. Untouched for mapped files.
+     * @return Whether there was a line left.
+     */
+    bool next_line(std::string_view* line, std::vector<Chunk>* chunks);
+    /**
+     * Reads whole lines: up to the first newline after min_bytes bytes, but
+     * for a streamed file at most up to the end of the current chunk.
+     * @param text Set to the lines, including their newlines.
+     * @param chunks As for next_line.
+     * @return Whether there was a line left.
+     */
+    bool next_lines(size_t min_bytes, std::string_view* text, std::vector<Chunk>* chunks);
+
+private:
+    /**
+     * Makes sure that a whole line (or the last, unterminated one) starts at
+     * m_position, reading a new chunk from a streamed file if needed.
+     * @return Whether there is a line left.
+     */
+    bool fill();
+    void keep_chunk(std::vector<Chunk>* chunks) const;
+
+    std::optional<MappedFile> m_mapped; // empty for a streamed file
+    int m_fd = -1; // descriptor of a streamed file
+    Chunk m_chunk; // the chunk of a streamed file that m_data shows
+    std::string_view m_data; // the mapping or *m_chunk
+    size_t m_position = 0; // start of the next line in m_data
+    size_t m_chunk_offset = 0; // offset of m_data in the file
+    bool m_eof = false;
+    bool m_open = false;
+};
+
+/**
+ * Returns the line starting at position and moves position past its newline.
+ * @param data The text to read from.
+ * @param position The position of the start of the line, updated to the start of the next line.
+ * @return The line without the trailing newline (and carriage return, for CRLF files).
+ */
+std::string_view next_line(std::string_view data, size_t* position);
@@ -3,6 +3,7 @@
 #include <cassert>
 #include <algorithm>
 #include <string>
+#include <string_view>
 
 Permutation::Permutation(std::vector<int> perm) : m_perm(std::move(perm)) {
     for (int x : m_perm) {
@@ -26,6 +27,15 @@ void Permutation::apply(std::vector<int>* vec) const {
     }
 }
 
+Permutation Permutation::operator*(const Permutation& other) const {
+    assert(n() == other.n());
+    std::vector<int> product(n());
+    for (int i = 1; i <= n(); i++) {
+        product[i - 1] = apply(other.apply(i));
+    }
+    return Permutation(std::move(product));
+}
+
 Permutation Permutation::inverse() const {
     std::vector<int> inv_perm(n());
     for (int i = 1; i <= n(); i++) {
@@ -34,38 +44,124 @@ Permutation Permutation::inverse() const {
     return Permutation(inv_perm);
 }
 
-std::vector<std::vector<int>> Permutation::cyclic_decomposition() const {
-    std::vector<bool> visited(n() + 1, false);
-    std::vector<std::tuple<int, int>> cycles; // (length, start)
-    std::vector<std::vector<int>> decomposition;
+Permutation Permutation::power(int j) const {
+    assert(j >= 1);
+    std::vector<int> powered(n());
+    CyclicDecomposition cycles = flat_cyclic_decomposition();
+    for (int i = 0; i < cycles.k(); i++) {
+        int c = cycles.lengths[i];
+        // v_p is mapped to v_q with q = p + j mod c.
+        for (int p = 0, q = j % c; p < c; p++) {
+            powered[cycles.at(i, p) - 1] = cycles.at(i, q);
+            if (++q == c) q = 0;
+        }
+    }
+    return Permutation(std::move(powered));
+}
 
-    for (int i = 1; i <= n(); i++) {
-        if (!visited[i]) {
-            int current = i;
-            int length = 0;
-            do {
-                visited[current] = true;
-                length++;
-                current = apply(current);
-            } while (current != i);
-            cycles.emplace_back(length, i);
+/**
+ * Computes the flat cyclic decomposition of a permutation of 1, ..., n, see
+ * Permutation::flat_cyclic_decomposition. The first pass walks the cycles
+ * from their minimum and counts their lengths; a counting sort by length then
+ * gives every cycle its offset, keeping cycles of equal length sorted by their
+ * minimum, and the second pass writes the cycles there.
+ * @param n The size of the permutation.
+ * @param image Callable int(int) applying the permutation (1-based).
+ * @param decomposition Set to the cycles.
+ * @param scratch At least 2n + 2 ints of work space.
+ */
+template <typename Image>
+static void flat_cycles(int n, Image image, CyclicDecomposition* decomposition, int* scratch) {
+    int* length_of = scratch; // for the minimum of a cycle its length, -1 for its other elements
+    int* next = scratch + n + 1; // number of cycles of length l, then where the next one of them goes
+    std::fill(scratch, scratch + 2 * n + 2, 0);
+    int k = 0;
+    for (int i = 1; i <= n; i++) {
+        if (length_of[i] != 0) continue;
+        int length = 0;
+        int current = i;
+        do {
+            length_of[current] = -1;
+            length++;
+            current = image(current);
+        } while (current != i);
+        length_of[i] = length;
+        next[length]++;
+        k++;
+    }
+    decomposition->vertices.resize(n);
+    decomposition->starts.resize(k);
+    decomposition->lengths.resize(k);
+    for (int l = n, pos = 0, c = 0; l >= 1; l--) {
+        int count = next[l];
+        next[l] = pos;
+        for (; count > 0; count--, c++) {
+            decomposition->starts[c] = pos;
+            decomposition->lengths[c] = l;
+            pos += l;
         }
     }
-    // Sort cycles by length (descending) and then by starting (minimum) point (ascending)
-    auto compare = [](const std::tuple<int, int>& a, const std::tuple<int, int>& b) {
-        return std::get<0>(a) > std::get<0>(b) || (std::get<0>(a) == std::get<0>(b) && std::get<1>(a) < std::get<1>(b));
-    };
-    std::sort(cycles.begin(), cycles.end(), compare);
-    for (const auto& cycle : cycles) {
-        int start = std::get<1>(cycle);
-        std::vector<int> current_cycle;
-        current_cycle.reserve(std::get<0>(cycle));
-        int current = start;
+    for (int i = 1; i <= n; i++) {
+        int length = length_of[i];
+        if (length <= 0) continue;
+        int* out = &decomposition->vertices[next[length]];
+        next[length] += length;
+        int current = i;
         do {
-            current_cycle.push_back(current);
-            current = apply(current);
-        } while (current != start);
-        decomposition.push_back(current_cycle);
+            *out++ = current;
+            current = image(current);
+        } while (current != i);
+    }
+}
+
+CyclicDecomposition CyclicDecomposition::power(int j) const {
+    CyclicDecomposition decomposition;
+    std::vector<int> scratch;
+    power(j, &decomposition, &scratch);
+    return decomposition;
+}
+
+void CyclicDecomposition::power(int j, CyclicDecomposition* decomposition, std::vector<int>* scratch) const {
+    assert(j >= 1);
+    assert(decomposition != this);
+    int n = vertices.size();
+    if ((int) scratch->size() < 3 * n + 2) {
+        scratch->resize(3 * n + 2);
+    }
+    // The j-th power maps v_p of the cycle (v_0 ... v_{c-1}) to v_q with
+    // q = p + j mod c. It is stored behind the work space of flat_cycles.
+    int* powered = scratch->data() + 2 * n + 1; // powered[v] for v = 1, ..., n
+    for (int i = 0; i < k(); i++) {
+        int c = lengths[i];
+        for (int p = 0, q = j % c; p < c; p++) {
+            powered[at(i, p)] = at(i, q);
+            if (++q == c) q = 0;
+        }
+    }
+    flat_cycles(n, [powered](int v) { return powered[v]; }, decomposition, scratch->data());
+}
+
+CyclicDecomposition Permutation::flat_cyclic_decomposition() const {
+    CyclicDecomposition decomposition;
+    std::vector<int> scratch;
+    flat_cyclic_decomposition(&decomposition, &scratch);
+    return decomposition;
+}
+
+void Permutation::flat_cyclic_decomposition(CyclicDecomposition* decomposition, std::vector<int>* scratch) const {
+    if ((int) scratch->size() < 2 * n() + 2) {
+        scratch->resize(2 * n() + 2);
+    }
+    flat_cycles(n(), [this](int v) { return m_perm[v - 1]; }, decomposition, scratch->data());
+}
+
+std::vector<std::vector<int>> Permutation::cyclic_decomposition() const {
+    CyclicDecomposition flat = flat_cyclic_decomposition();
+    std::vector<std::vector<int>> decomposition;
+    decomposition.reserve(flat.k());
+    for (int i = 0; i < flat.k(); i++) {
+        decomposition.emplace_back(flat.vertices.begin() + flat.starts[i],
+                                   flat.vertices.begin() + flat.starts[i] + flat.lengths[i]);
     }
     return decomposition;
 }
@@ -84,8 +180,23 @@ std::string Permutation::cyclic_decomposition_string() const {
     return out;
 }
 
-Permutation parse_automorphism(const std::string& str) {
+std::optional<Permutation> parse_automorphism(std::string_view str, int n) {
     std::vector<int> perm;
-    process_csv(str, 0, ',', &perm);
-    return Permutation(perm);
-}
\ No newline at end of file
+    perm.reserve(n);
+    std::vector<char> seen(n + 1, false);
+    bool valid = true;
+    // The whole line is one list, so the terminator is the end of the line.
+    size_t end = scan_csv(str, 0, '\n', [&](int x) {
+        if ((int) perm.size() == n || x < 1 || x > n || seen[x]) {
+            valid = false;
+            return false;
+        }
+        seen[x] = true;
+        perm.push_back(x);
+        return true;
+    });
+    if (!valid || (int) perm.size() != n || end < str.size()) {
+        return std::nullopt;
+    }
+    return Permutation(std::move(perm));
+}
@@ -2,6 +2,40 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
+#include <optional>
+
+/**
+ * The cyclic decomposition of a permutation in a flat layout: the elements of
+ * all cycles one after the other, so there is no allocation per cycle.
+ * Cycles are sorted by length (descending) and then by their minimum
+ * (ascending), and every cycle starts at its minimum.
+ */
+struct CyclicDecomposition {
+    std::vector<int> vertices; // all cycles in order, each in cycle order
+    std::vector<int> starts; // cycle i (0-based) starts at vertices[starts[i]]
+    std::vector<int> lengths; // lengths[i] = length of cycle i
+    /** @return The number of cycles. */
+    int k() const { return lengths.size(); }
+    /** @return The p-th element (0-based) of the i-th cycle (0-based). */
+    int at(int i, int p) const { return vertices[starts[i] + p]; }
+    /**
+     * Computes the cyclic decomposition of the j-th power of the permutation
+     * directly from its cycles: a cycle of length c splits into gcd(c, j)
+     * cycles of length c / gcd(c, j).
+     * @param j The exponent, at least 1.
+     * @return The same cycles as Permutation::power(j).flat_cyclic_decomposition().
+     */
+    CyclicDecomposition power(int j) const;
+    /**
+     * Same as power(j), but reuses the arrays of decomposition and scratch,
+     * so repeated calls do not allocate once these are large enough.
+     * @param j The exponent, at least 1.
+     * @param decomposition Set to the cycles of the j-th power, must not be this.
+     * @param scratch Work space, grown to 3n + 2 ints if it is smaller.
+     */
+    void power(int j, CyclicDecomposition* decomposition, std::vector<int>* scratch) const;
+};
 
 class Permutation {
 public:
@@ -27,16 +61,44 @@ public:
      * @param vec A pointer to a vector of integers to apply the permutation to.
      */
     void apply(std::vector<int>* vec) const;
+    /**
+     * Composes two permutations of the same size.
+     * @param other The permutation applied first.
+     * @return The permutation x -> apply(other.apply(x)).
+     */
+    Permutation operator*(const Permutation& other) const;
     /**
      * Computes the inverse of the permutation.
      * @return A new Permutation object representing the inverse permutation.
      */
     Permutation inverse() const;
+    /**
+     * Computes a power of the permutation.
+     * @param j The exponent, at least 1.
+     * @return The permutation applied j times.
+     */
+    Permutation power(int j) const;
     /**
      * Computes the cyclic decomposition of the permutation.
      * @return A vector of vectors, where each inner vector represents a cycle in the permutation.
      */
     std::vector<std::vector<int>> cyclic_decomposition() const;
+    /**
+     * Computes the cyclic decomposition of the permutation in a flat layout,
+     * with the same cycles in the same order as cyclic_decomposition().
+     * @return The cycles of the permutation.
+     */
+    CyclicDecomposition flat_cyclic_decomposition() const;
+    /**
+     * Same as flat_cyclic_decomposition(), but reuses the arrays of
+     * decomposition and scratch, so repeated calls do not allocate once these
+     * are large enough. The cycles are walked twice: once to count their
+     * lengths, which gives every cycle its place in the result, and once to
+     * write their elements there.
+     * @param decomposition Set to the cycles of the permutation.
+     * @param scratch Work space, grown to 2n + 2 ints if it is smaller.
+     */
+    void flat_cyclic_decomposition(CyclicDecomposition* decomposition, std::vector<int>* scratch) const;
     /**
      * Encodes the permutation as a human-readable string.
      * @return A string representation of the cyclic decomposition.
@@ -47,5 +109,12 @@ private:
     std::vector<int> m_perm;
 };
 
-// Convert a string of the form "2,3,1" into a Permutation object representing the permutation that maps 1->2, 2->3, 3->1.
-Permutation parse_automorphism(const std::string& str);
\ No newline at end of file
+/**
+ * Converts a string of the form "2,3,1" into a Permutation object representing
+ * the permutation that maps 1->2, 2->3, 3->1. Spaces around the numbers and a
+ * trailing carriage return are allowed, see scan_csv.
+ * @param str The line with the permutation.
+ * @param n The number of vertices of the graph the permutation belongs to.
+ * @return The permutation, or nothing if str is not a permutation of 1, ..., n.
+ */
+std::optional<Permutation> parse_automorphism(std::string_view str, int n);
\ No newline at end of file
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Runs a read -> process -> write pipeline over batches of work.
+ * The calling thread reads batches, a pool of worker threads processes them
+ * and a writer thread consumes the processed batches in the order they were
+ * read, so the output stays aligned with the input. At most 2 * threads
+ * batches are in flight at any time.
+ * Batches are recycled: once written, a batch is emptied with Batch::clear(),
+ * which keeps the capacity of its buffers, and read into again. So after the
+ * first few batches the pipeline itself does not allocate.
+ * @param threads Number of worker threads. With 1 (or less) everything runs
+ *                in the calling thread, one batch at a time.
+ * @param read Callable bool(Batch&) that fills an empty (new or cleared) batch with the next
+ *             part of the input and returns false once there is no more input.
+ * @param process Callable void(Batch&), called concurrently for different batches.
+ * @param write Callable void(Batch&), called for one batch at a time, in input order.
+ */
+template <typename Batch, typename Read, typename Process, typename Write>
+void ordered_pipeline(int threads, Read read, Process process, Write write) {
+    if (threads <= 1) {
+        Batch batch;
+        while (read(batch)) {
+            process(batch);
+            write(batch);
+            batch.clear();
+        }
+        return;
+    }
+    std::mutex mutex;
+    std::condition_variable work_ready, result_ready, slot_free;
+    std::deque<std::pair<size_t, std::unique_ptr<Batch>>> queue; // read, not yet processed
+    std::map<size_t, std::unique_ptr<Batch>> results; // processed, not yet written
+    std::vector<std::unique_ptr<Batch>> free_batches; // written and cleared, to be read into again
+    size_t read_count = 0;
+    size_t written_count = 0;
+    bool input_done = false;
+    const size_t max_in_flight = 2 * threads;
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                work_ready.wait(lock, [&] { return !queue.empty() || input_done; });
+                if (queue.empty()) return;
+                auto [index, batch] = std::move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+                process(*batch);
+                lock.lock();
+                results.emplace(index, std::move(batch));
+                result_ready.notify_one();
+            }
+        });
+    }
+    std::thread writer([&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            result_ready.wait(lock, [&] {
+                return results.count(written_count) > 0 || (input_done && written_count == read_count);
+            });
+            auto next = results.find(written_count);
+            if (next == results.end()) return; // everything is written
+            std::unique_ptr<Batch> batch = std::move(next->second);
+            results.erase(next);
+            lock.unlock();
+            write(*batch);
+            batch->clear();
+            lock.lock();
+            written_count++;
+            free_batches.push_back(std::move(batch));
+            slot_free.notify_one();
+        }
+    });
+    while (true) {
+        std::unique_ptr<Batch> batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!free_batches.empty()) {
+                batch = std::move(free_batches.back());
+                free_batches.pop_back();
+            }
+        }
+        if (!batch) batch = std::make_unique<Batch>();
+        bool more = read(*batch);
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!more) {
+            input_done = true;
+            break;
+        }
+        queue.emplace_back(read_count++, std::move(batch));
+        work_ready.notify_one();
+        slot_free.wait(lock, [&] { return read_count - written_count < max_in_flight; });
+    }
+    work_ready.notify_all();
+    result_ready.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    writer.join();
+}
@@ -0,0 +1,44 @@
+#include "progress.h"
+#include <stdio.h>
+
+ProgressReporter::ProgressReporter(const char* action, size_t total_bytes, bool enabled)
+    : m_action(action), m_total_bytes(total_bytes), m_enabled(enabled),
+      m_start(clock::now()), m_last_print(m_start) {
+}
+
+void ProgressReporter::update(size_t bytes_done, long long graphs_done) {
+    m_bytes_done = bytes_done;
+    m_graphs_done = graphs_done;
+    if (!m_enabled) return;
+    clock::time_point now = clock::now();
+    if (now - m_last_print < interval) return;
+    m_last_print = now;
+    print(false);
+}
+
+void ProgressReporter::finish() {
+    if (!m_enabled) return;
+    print(true);
+}
+
+void ProgressReporter::print(bool final) {
+    double seconds = std::chrono::duration<double>(clock::now() - m_start).count();
+    if (seconds <= 0) seconds = 1e-9;
+    double graphs_per_second = m_graphs_done / seconds;
+    double bytes_per_second = m_bytes_done / seconds;
+    fprintf(stderr, "\r%s: ", m_action);
+    if (m_total_bytes > 0) {
+        fprintf(stderr, "%5.1f%%, ", 100.0 * m_bytes_done / m_total_bytes);
+    }
+    fprintf(stderr, "%lld graphs, %.0f graphs/s, %.1f MB/s", m_graphs_done, graphs_per_second, bytes_per_second / 1e6);
+    // \x1b[K clears what is left of a longer previous line.
+    if (final) {
+        fprintf(stderr, ", %.1f s\x1b[K\n", seconds);
+    } else if (m_total_bytes == 0) {
+        fprintf(stderr, "\x1b[K");
+    } else {
+        double eta = bytes_per_second > 0 ? (m_total_bytes - m_bytes_done) / bytes_per_second : 0;
+        fprintf(stderr, ", ETA %.0f s\x1b[K", eta);
+    }
+    fflush(stderr);
+}
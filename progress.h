@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+/**
+ * Reports the progress of processing a file on stderr.
+ * Progress is measured by the offset reached in the input, so the total
+ * amount of work is known from the file size without scanning it first.
+ * The status line is redrawn at most once per interval, no matter how often
+ * update() is called, and shows graphs/s, MB/s and the estimated time left.
+ */
+class ProgressReporter {
+public:
+    /**
+     * @param action The word shown at the start of the status line, e.g. "Decoding".
+     * @param total_bytes The size of the input, or 0 if it is not known (a pipe);
+     *                    the percentage and the estimated time left are then left out.
+     * @param enabled Whether anything is printed at all.
+     */
+    ProgressReporter(const char* action, size_t total_bytes, bool enabled);
+    /**
+     * Records the progress made so far and redraws the status line if the
+     * interval has passed since it was last drawn.
+     * @param bytes_done The offset in the input up to which everything is processed.
+     * @param graphs_done The number of graphs processed so far.
+     */
+    void update(size_t bytes_done, long long graphs_done);
+    /**
+     * Draws the final status line and ends it with a newline.
+     */
+    void finish();
+
+private:
+    void print(bool final);
+
+    using clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds interval{500};
+    const char* m_action;
+    size_t m_total_bytes;
+    bool m_enabled;
+    clock::time_point m_start;
+    clock::time_point m_last_print;
+    size_t m_bytes_done = 0;
+    long long m_graphs_done = 0;
+};
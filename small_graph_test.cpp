@@ -0,0 +1,172 @@
+// Checks that the fast path for graphs with at most 64 vertices (encode_small,
+// decode_small) gives the same results as the general path, on random graphs
+// with random automorphisms. Run with "make test".
+#include "graph.h"
+#include "permutation.h"
+#include <iostream>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what, const std::string& input) {
+    if (!ok) {
+        failures++;
+        if (failures <= 10) std::cerr << "FAILED: " << what << " for " << input << std::endl;
+    }
+}
+
+/**
+ * A random permutation of 1..n whose cycle type is random, semiregular,
+ * the identity or a long cycle with fixed points.
+ */
+static std::vector<int> random_automorphism(int n, std::mt19937& rng) {
+    std::vector<int> vertices(n);
+    std::iota(vertices.begin(), vertices.end(), 0);
+    std::shuffle(vertices.begin(), vertices.end(), rng);
+    std::vector<int> lengths;
+    switch (rng() % 4) {
+        case 0: // random
+            for (int left = n; left > 0;) {
+                int c = 1 + rng() % left;
+                lengths.push_back(c);
+                left -= c;
+            }
+            break;
+        case 1: { // semiregular
+            std::vector<int> divisors;
+            for (int d = 1; d <= n; d++) {
+                if (n % d == 0) divisors.push_back(d);
+            }
+            int c = divisors[rng() % divisors.size()];
+            lengths.assign(n / c, c);
+            break;
+        }
+        case 2: // identity
+            lengths.assign(n, 1);
+            break;
+        default: { // one cycle and fixed points
+            int c = 1 + rng() % n;
+            lengths.push_back(c);
+            lengths.insert(lengths.end(), n - c, 1);
+        }
+    }
+    std::vector<int> perm(n);
+    int start = 0;
+    for (int c : lengths) {
+        for (int i = 0; i < c; i++) {
+            perm[vertices[start + i]] = vertices[start + (i + 1) % c] + 1;
+        }
+        start += c;
+    }
+    return perm;
+}
+
+/**
+ * A random graph invariant under the permutation: a union of edge orbits.
+ */
+static Graph random_symmetric_graph(const std::vector<int>& perm, std::mt19937& rng) {
+    int n = perm.size();
+    std::vector<std::vector<char>> adjacent(n, std::vector<char>(n, false));
+    int orbits = rng() % (2 * n + 1);
+    for (int t = 0; t < orbits; t++) {
+        int a = rng() % n, b = rng() % n;
+        if (a == b) continue;
+        int x = a, y = b;
+        do {
+            adjacent[x][y] = adjacent[y][x] = true;
+            x = perm[x] - 1;
+            y = perm[y] - 1;
+        } while (x != a || y != b);
+    }
+    std::vector<std::vector<int>> neighbors(n + 1); // padded to use 1-based indexing
+    for (int u = 0; u < n; u++) {
+        for (int v = 0; v < n; v++) {
+            if (adjacent[u][v]) neighbors[u + 1].push_back(v + 1);
+        }
+    }
+    return Graph(neighbors);
+}
+
+static std::string automorphism_string(const std::vector<int>& perm) {
+    std::string out;
+    for (size_t i = 0; i < perm.size(); i++) {
+        if (i > 0) out += ',';
+        out += std::to_string(perm[i]);
+    }
+    return out;
+}
+
+int main() {
+    std::mt19937 rng(1);
+    int graphs = 0;
+    sparsegraph sg;
+    SG_INIT(sg);
+    for (int t = 0; t < 3000; t++) {
+        int n = 1 + rng() % 64;
+        std::vector<int> perm = random_automorphism(n, rng);
+        Graph g = random_symmetric_graph(perm, rng);
+        Permutation automorphism(perm);
+        std::string g6 = g.to_graph6();
+        std::string automorphism_str = automorphism_string(perm);
+        graphs++;
+        for (AdjacencyEncoding encoding : {AdjacencyEncoding::sparse, AdjacencyEncoding::dense, AdjacencyEncoding::automatic}) {
+            std::string expected = g.encode(automorphism, encoding);
+            std::string out = "prefix";
+            check(encode_small(g6, automorphism_str, encoding, false, &out) && out == "prefix" + expected,
+                  "encode_small == Graph::encode", g6);
+            out.clear();
+            check(encode_small(">>graph6<<" + g6, automorphism_str, encoding, true, &out) &&
+                  out == g.encode_shortest(automorphism, encoding), "encode_small == Graph::encode_shortest", g6);
+
+            out.clear();
+            check(decode_small(expected, false, &out) && out == decode_to_graph6(expected),
+                  "decode_small == decode_to_graph6", expected);
+            out.clear();
+            check(decode_small(expected, true, &out) && nauty_decode(out) == decode(expected),
+                  "decode_small sparse6 == decode", expected);
+            // The general path writes the same sparse6 bytes.
+            decode_to_sparsegraph(expected, &sg);
+            check(out == to_sparse6(sg), "decode_small sparse6 == to_sparse6(decode_to_sparsegraph)", expected);
+            // Truncated headers are left to the general path.
+            out.clear();
+            check(!decode_small(expected.substr(0, 3), false, &out) && out.empty(), "truncated header rejected", expected);
+        }
+        // Lines that are not a permutation of the vertices are left to the general path.
+        std::string out;
+        std::vector<std::string> invalid = {automorphism_string(std::vector<int>(perm.begin(), perm.end() - 1)),
+                                            automorphism_str + "," + std::to_string(n + 1), automorphism_str + "x"};
+        if (n > 1) {
+            std::vector<int> duplicate = perm;
+            duplicate[0] = duplicate[1];
+            invalid.push_back(automorphism_string(duplicate));
+        }
+        for (const std::string& line : invalid) {
+            check(!encode_small(g6, line, AdjacencyEncoding::sparse, false, &out) && out.empty(),
+                  "invalid automorphism \"" + line + "\" rejected", g6);
+        }
+        // Blanks around the numbers and a carriage return are accepted.
+        std::string spaced;
+        for (int x : perm) spaced += (spaced.empty() ? " " : " , ") + std::to_string(x);
+        check(encode_small(g6, spaced + " \r", AdjacencyEncoding::sparse, false, &out) &&
+              out == g.encode(automorphism, AdjacencyEncoding::sparse), "spaced automorphism accepted", g6);
+        // Graphs the fast path does not handle.
+        out.clear();
+        check(!encode_small(g.to_sparse6(), automorphism_str, AdjacencyEncoding::sparse, false, &out) && out.empty(),
+              "sparse6 left to the general path", g6);
+    }
+    std::vector<int> identity(65);
+    std::iota(identity.begin(), identity.end(), 1);
+    Graph large = random_symmetric_graph(identity, rng);
+    std::string out;
+    check(!encode_small(large.to_graph6(), automorphism_string(identity), AdjacencyEncoding::sparse, false, &out) &&
+          !decode_small(large.encode(Permutation(identity), AdjacencyEncoding::sparse), false, &out) && out.empty(),
+          "n = 65 left to the general path", large.to_graph6());
+
+    SG_FREE(sg);
+    std::cout << graphs << " graphs, " << failures << " failures" << std::endl;
+    return failures == 0 ? 0 : 1;
+}